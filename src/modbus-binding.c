@@ -28,11 +28,36 @@
 
 #include "modbus-binding.h"
 #include <afb-helpers4/afb-req-utils.h>
+#include <errno.h>
+#include <semaphore.h>
+#include <time.h>
+#include <unistd.h>
 
 #ifndef MB_DEFAULT_POLLING_PERIOD
 #define MB_DEFAULT_POLLING_PERIOD 100
 #endif
 
+// delta events sent between two full snapshots
+#ifndef MB_DELTA_SNAPSHOT
+#define MB_DELTA_SNAPSHOT 10
+#endif
+
+// consecutive timeouts opening an RTU breaker, and delay between probes
+#ifndef MB_BREAKER_TIMEOUTS
+#define MB_BREAKER_TIMEOUTS 3
+#endif
+#ifndef MB_BREAKER_PROBE_MS
+#define MB_BREAKER_PROBE_MS 10000
+#endif
+
+// learned response timeout = p99 latency x factor, never below the minimum
+#ifndef MB_TIMEOUT_FACTOR
+#define MB_TIMEOUT_FACTOR 3.0
+#endif
+#ifndef MB_TIMEOUT_MIN_MS
+#define MB_TIMEOUT_MIN_MS 10
+#endif
+
 // static binding plugin store
 static plugin_store_t plugins = PLUGIN_STORE_INITIAL;
 
@@ -86,14 +111,10 @@ static void InfoRtu(afb_req_t request, unsigned argc, afb_data_t const args[]) {
                       rtus[idx].connection->uri, "info", rtus[idx].info);
         break;
       case 2:
-        status = ModbusRtuIsConnected(afb_req_get_api(request), &rtus[idx]);
-        if (status < 0) {
-          rp_jsonc_pack(&elemJ, "{ss ss ss}", "uid", rtus[idx].uid, "uri",
-                        rtus[idx].connection->uri, "info", rtus[idx].info);
-        } else {
-          rp_jsonc_pack(&elemJ, "{ss ss ss sb}", "uid", rtus[idx].uid, "uri",
-                        rtus[idx].connection->uri, "info", rtus[idx].info, "status", status);
-        }
+        // cached link and breaker state, a silent device must not hold the verb
+        rp_jsonc_pack(&elemJ, "{ss ss ss sb}", "uid", rtus[idx].uid, "uri",
+                      rtus[idx].connection->uri, "info", rtus[idx].info,
+                      "status", ModbusRtuIsOnline(&rtus[idx]));
         break;
       }
       json_object_array_add(responseJ, elemJ);
@@ -105,9 +126,15 @@ static void InfoRtu(afb_req_t request, unsigned argc, afb_data_t const args[]) {
 
     rtusJ = json_object_new_array();
     for (idx = 0; rtus[idx].uid; idx++) {
-      status = ModbusRtuIsConnected(afb_req_get_api(request), &rtus[idx]);
-      err = rp_jsonc_pack(&statusJ, "{ss si sb}", "uri", rtus[idx].connection->uri,
-                          "slaveid", rtus[idx].slaveid, "status", status >= 0);
+      status = ModbusRtuIsOnline(&rtus[idx]);
+      err = rp_jsonc_pack(&statusJ, "{ss ss* ss so so si sb so so*}", "uri", rtus[idx].connection->uri,
+                          "link", rtus[idx].connection->uid,
+                          "state", ModbusLinkStateName(rtus[idx].connection),
+                          "breaker", ModbusRtuBreakerInfo(&rtus[idx]),
+                          "latency", ModbusRtuLatencyInfo(&rtus[idx]),
+                          "slaveid", rtus[idx].slaveid, "status", status,
+                          "queues", ModbusConnectionQueues(rtus[idx].connection),
+                          "schedule", ModbusSchedulerInfo(rtus[idx].connection, &rtus[idx]));
 
       // prepare array to hold every sensor verbs
       sensorsJ = json_object_new_array();
@@ -201,7 +228,7 @@ static void SensorDynRequest(afb_req_t request, unsigned argc,
  * @param period output, polling period in milliseconds; 0 if there's nothing polling related in config
  * @return error code, 0 = OK, <0 = KO
  */
-static int ParsePollingPeriod(afb_api_t api, json_object *config, uint *period) {
+int ParsePollingPeriod(afb_api_t api, json_object *config, uint *period) {
   int err;
   double period_s = 0, period_m = 0, freq = 0;
   *period = 0;
@@ -237,6 +264,93 @@ OnErrorExit:
   return -1;
 }
 
+/**
+ * Parse RTU registers which must never be covered by a block read
+ *
+ * @param api AFB API for logging purposes
+ * @param rtu RTU receiving the ranges
+ * @param rangesJ JSON array of {type?, register, count?} objects
+ * @return error code, 0 = OK, <0 = KO
+ */
+static int ParseNoReadRanges(afb_api_t api, ModbusRtuT *rtu, json_object *rangesJ) {
+  const char *type;
+  int err, count;
+  ModbusRangeT *range;
+
+  if (!json_object_is_type(rangesJ, json_type_array)) {
+    AFB_API_ERROR(api, "ParseNoReadRanges: no_read_ranges should be an array rtu=%s", rtu->uid);
+    goto OnErrorExit;
+  }
+
+  count = (int)json_object_array_length(rangesJ);
+  rtu->noread = (ModbusRangeT *)calloc(count + 1, sizeof(ModbusRangeT));
+  if (!rtu->noread) {
+    AFB_API_ERROR(api, "ParseNoReadRanges: out of memory");
+    goto OnErrorExit;
+  }
+
+  for (int idx = 0; idx < count; idx++) {
+    json_object *rangeJ = json_object_array_get_idx(rangesJ, idx);
+    range = &rtu->noread[idx];
+    type = NULL;
+    range->count = 1;
+
+    err = rp_jsonc_unpack(rangeJ, "{s?s,si,s?i !}", "type", &type,
+                          "register", &range->registry, "count", &range->count);
+    if (err || !range->count) {
+      AFB_API_ERROR(api, "ParseNoReadRanges: invalid range rtu=%s range=%s",
+                    rtu->uid, json_object_get_string(rangeJ));
+      goto OnErrorExit;
+    }
+
+    if (type) {
+      range->function = mbFunctionFind(api, type);
+      if (!range->function->uid) {
+        AFB_API_ERROR(api, "ParseNoReadRanges: invalid Modbus Type=%s rtu=%s",
+                      type, rtu->uid);
+        goto OnErrorExit;
+      }
+    }
+  }
+
+  return 0;
+
+OnErrorExit:
+  return -1;
+}
+
+// deadband is either an absolute value or a percentage string as "2.5%"
+int ParseDeadband(afb_api_t api, json_object *deadbandJ, double *deadband, bool *percent) {
+  const char *value;
+  char *end;
+
+  if (!deadbandJ)
+    return 0;
+
+  if (json_object_is_type(deadbandJ, json_type_string)) {
+    value = json_object_get_string(deadbandJ);
+    *deadband = strtod(value, &end);
+    if (end == value || strcmp(end, "%"))
+      goto OnErrorExit;
+    *percent = true;
+  } else if (json_object_is_type(deadbandJ, json_type_double) ||
+             json_object_is_type(deadbandJ, json_type_int)) {
+    *deadband = json_object_get_double(deadbandJ);
+    *percent = false;
+  } else {
+    goto OnErrorExit;
+  }
+
+  if (*deadband < 0)
+    goto OnErrorExit;
+  return 0;
+
+OnErrorExit:
+  AFB_API_ERROR(api, "ParseDeadband: invalid deadband=%s (number or \"N%%\" expected)",
+                json_object_to_json_string(deadbandJ));
+  return -1;
+}
+
 static int SensorLoadOne(afb_api_t api, ModbusRtuT *rtu, ModbusSensorT *sensor,
                          json_object *sensorJ) {
   int err = 0;
@@ -245,7 +359,8 @@ static int SensorLoadOne(afb_api_t api, ModbusRtuT *rtu, ModbusSensorT *sensor,
   const char *format = NULL;
   const char *privilege = NULL;
   afb_auth_t *authent = NULL;
-  json_object *argsJ = NULL;
+  json_object *argsJ = NULL, *deadbandJ = NULL;
+  int delta = 0;
   ModbusSourceT source;
 
   // should already be allocated
@@ -257,16 +372,26 @@ static int SensorLoadOne(afb_api_t api, ModbusRtuT *rtu, ModbusSensorT *sensor,
   sensor->period = rtu->period;
   sensor->idle = rtu->idle;
   sensor->count = 1;
+  sensor->snapshot = MB_DELTA_SNAPSHOT;
 
   err = rp_jsonc_unpack(
-      sensorJ, "{ss,ss,si,s?s,s?s,s?s,s?i,s?i,s?o,s?o,s?o}",
+      sensorJ, "{ss,ss,si,s?s,s?s,s?s,s?i,s?i,s?o,s?o,s?o,s?o,s?F,s?b,s?i}",
       "uid", &sensor->uid, "type", &type, "register", &sensor->registry,
       "info", &sensor->info, "privilege", &privilege, "format", &format,
       "idle", &sensor->idle, "count", &sensor->count, "usage", &sensor->usage,
-      "sample", &sensor->sample, "args", &argsJ);
+      "sample", &sensor->sample, "args", &argsJ, "deadband", &deadbandJ,
+      "hysteresis", &sensor->hysteresis, "delta", &delta,
+      "snapshot", &sensor->snapshot);
   if (err)
     goto ParsingErrorExit;
 
+  // a single element is always sent whole
+  sensor->delta = delta && sensor->count > 1;
+
+  err = ParseDeadband(api, deadbandJ, &sensor->deadband, &sensor->deadbandpct);
+  if (err)
+    goto OnErrorExit;
+
   err = ParsePollingPeriod(api, sensorJ, &period);
   if (err < 0) {
     AFB_API_ERROR(api, "SensorLoadOne: failed to parse polling period");
@@ -349,11 +474,56 @@ OnErrorExit:
   return -1;
 }
 
+/**
+ * Share one connection between every RTU declaring the same link
+ *
+ * The connection is looked up by normalized URI. When the link is already
+ * known, the caller connection is released and replaced by the shared one
+ * (with its I/O thread and scheduler), options of the first declaration
+ * win. Otherwise the connection is added to the registry.
+ *
+ * @return 0 = OK, -1 = out of memory
+ */
+static int ModbusRegisterConnection(afb_api_t api, CtlHandleT *controller,
+                                    ModbusConnectionT **connection, const char *uid) {
+  ModbusConnectionT *shared;
+  char *key;
+
+  key = ModbusNormalizeURI((*connection)->uri);
+  if (!key) {
+    AFB_API_ERROR(api, "ModbusRegisterConnection: out of memory");
+    return -1;
+  }
+
+  for (shared = controller->registry; shared; shared = shared->registered) {
+    if (strcmp(shared->key, key))
+      continue;
+    if ((*connection)->pipeline != shared->pipeline ||
+        (*connection)->connections != shared->connections) {
+      AFB_API_WARNING(api, "ModbusRegisterConnection: uid=%s shares uri=%s, link options of "
+                      "its first declaration apply", uid, key);
+    }
+    AFB_API_NOTICE(api, "ModbusRegisterConnection: uid=%s shares uri=%s", uid, key);
+    free(key);
+    free(*connection);
+    *connection = shared;
+    return 0;
+  }
+
+  (*connection)->key = key;
+  (*connection)->registered = controller->registry;
+  controller->registry = *connection;
+  return 0;
+}
+
 static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, json_object *rtuJ) {
   int err = 0;
   uint period = 0;
-  json_object *sensorsJ;
+  json_object *sensorsJ, *noreadJ = NULL;
   afb_auth_t *authent = NULL;
+  const char *link = NULL;
+  int autotimeout = 0;
+  ModbusConnectionT *shared;
   ModbusRtuT *rtu = &controller->modbus[rtu_idx];
 
   // should already be allocated
@@ -361,6 +531,13 @@ static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, jso
   assert(api);
 
   memset(rtu, 0, sizeof(ModbusRtuT)); // default is empty
+  rtu->maxgap = -1;
+  rtu->breaker = -1;
+  rtu->probe = -1;
+  rtu->timeoutmin = MB_TIMEOUT_MIN_MS;
+  rtu->timeoutfactor = MB_TIMEOUT_FACTOR;
+  rtu->unit = -1;
+  pthread_mutex_init(&rtu->mutex, NULL);
   rtu->connection = (ModbusConnectionT *)calloc(1, sizeof(ModbusConnectionT));
   if (!rtu->connection) {
     AFB_API_ERROR(api, "ModbusLoadOne: out of memory");
@@ -368,17 +545,49 @@ static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, jso
   }
 
   err = rp_jsonc_unpack(
-      rtuJ, "{ss,s?s,s?s,s?s,s?i,s?s,s?i,s?i,s?i,s?i,so}",
-      "uid", &rtu->uid, "info", &rtu->info, "uri", &rtu->connection->uri,
+      rtuJ, "{ss,s?s,s?s,s?s,s?s,s?i,s?s,s?i,s?i,s?i,s?i,s?i,s?i,s?i,s?i,s?i,s?i,s?b,s?i,s?F,s?o,so}",
+      "uid", &rtu->uid, "info", &rtu->info, "uri", &rtu->connection->uri, "link", &link,
       "privileges", &rtu->privileges, "autostart", &rtu->autostart,
-      "prefix", &rtu->prefix, "slaveid", &rtu->slaveid, "debug", &rtu->debug,
-      "timeout", &rtu->timeout, "idle", &rtu->idle, "sensors", &sensorsJ);
+      "prefix", &rtu->prefix, "slaveid", &rtu->slaveid, "unit", &rtu->unit, "debug", &rtu->debug,
+      "timeout", &rtu->timeout, "idle", &rtu->idle, "max_gap", &rtu->maxgap,
+      "pipeline", &rtu->connection->pipeline, "connections", &rtu->connection->connections,
+      "breaker", &rtu->breaker, "breaker_probe", &rtu->probe,
+      "auto_timeout", &autotimeout, "timeout_min", &rtu->timeoutmin,
+      "timeout_factor", &rtu->timeoutfactor,
+      "no_read_ranges", &noreadJ, "sensors", &sensorsJ);
   if (err) {
     AFB_API_ERROR(api, "Fail to parse rtu JSON : (%s)",
                   json_object_to_json_string(rtuJ));
     goto OnErrorExit;
   }
 
+  // 0 keeps the libmodbus default, anything else must be a unicast address
+  if (rtu->slaveid < 0 || rtu->slaveid > 247) {
+    AFB_API_ERROR(api, "ModbusLoadOne: uid=%s invalid slaveid=%d (0-247)",
+                  rtu->uid, rtu->slaveid);
+    goto OnErrorExit;
+  }
+
+  rtu->autotimeout = autotimeout;
+  if (rtu->timeoutfactor < 1)
+    rtu->timeoutfactor = MB_TIMEOUT_FACTOR;
+
+  if (rtu->breaker < 0)
+    rtu->breaker = MB_BREAKER_TIMEOUTS;
+  if (rtu->probe <= 0)
+    rtu->probe = MB_BREAKER_PROBE_MS;
+
+  if (link && rtu->connection->uri) {
+    AFB_API_ERROR(api, "ModbusLoadOne: uid=%s cannot declare both uri and link", rtu->uid);
+    goto OnErrorExit;
+  }
+
+  if (noreadJ) {
+    err = ParseNoReadRanges(api, rtu, noreadJ);
+    if (err)
+      goto OnErrorExit;
+  }
+
   // create an admin command for RTU
   if (rtu->privileges) {
     authent = (afb_auth_t *)calloc(1, sizeof(afb_auth_t));
@@ -411,15 +620,26 @@ static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, jso
     goto OnErrorExit;
   }
 
-  // if uri is provided let's try to connect now
-  if (rtu->connection->uri && rtu->autostart) {
-    err = ModbusRtuConnect(api, rtu->connection, rtu->uid);
-    if (err) {
-      AFB_API_ERROR(api, "ModbusLoadOne: fail to connect TTY/RTU uid=%s uri=%s",
-                    rtu->uid, rtu->connection->uri);
-      if (rtu->autostart > 1)
-        goto OnErrorExit;
+  if (link) {
+    // named links are connected at startup
+    for (shared = controller->registry; shared; shared = shared->registered) {
+      if (shared->uid && !strcmp(shared->uid, link))
+        break;
     }
+    if (!shared) {
+      AFB_API_ERROR(api, "ModbusLoadOne: uid=%s unknown link=%s", rtu->uid, link);
+      goto OnErrorExit;
+    }
+    free(rtu->connection);
+    rtu->connection = shared;
+  } else if (rtu->connection->uri && rtu->autostart) {
+    // RTUs of the same link share one connection, links are connected all
+    // at once when the whole config is loaded
+    err = ModbusRegisterConnection(api, controller, &rtu->connection, rtu->uid);
+    if (err)
+      goto OnErrorExit;
+    if (rtu->autostart > rtu->connection->autostart)
+      rtu->connection->autostart = rtu->autostart;
   } else {
     // else use global context/uri, which is already connected
     if (!controller->connection) {
@@ -430,13 +650,6 @@ static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, jso
     free(rtu->connection);
     rtu->connection = controller->connection;
   }
-  err = ModbusRtuSetSlave(api, rtu);
-  if (err) {
-    AFB_API_ERROR(api, "ModbusLoadOne: failed to set slave ID uid=%s uri=%s",
-                  rtu->uid, rtu->connection->uri);
-    if (rtu->autostart > 1)
-      goto OnErrorExit;
-  }
 
   // loop on sensors
   if (json_object_is_type(sensorsJ, json_type_array)) {
@@ -465,6 +678,11 @@ static int ModbusLoadOne(afb_api_t api, CtlHandleT *controller, int rtu_idx, jso
       goto OnErrorExit;
   }
 
+  // group contiguous sensors to read them with one transaction
+  err = ModbusRtuPlanBlocks(api, rtu);
+  if (err)
+    goto OnErrorExit;
+
   return 0;
 
 OnErrorExit:
@@ -521,14 +739,85 @@ OnErrorExit:
   return -1;
 }
 
+// declare one named link, its connection is opened at startup
+static int ReadOneLink(afb_api_t api, CtlHandleT *controller, json_object *linkJ) {
+  ModbusConnectionT *connection, *registered;
+  const char *uid;
+  int pipeline = 0, connections = 0;
+  int err;
+
+  connection = (ModbusConnectionT *)calloc(1, sizeof(ModbusConnectionT));
+  if (!connection) {
+    AFB_API_ERROR(api, "ReadOneLink: out of memory");
+    goto OnErrorExit;
+  }
+
+  err = rp_jsonc_unpack(linkJ, "{ss ss s?i s?i !}", "uid", &uid, "uri", &connection->uri,
+                        "pipeline", &pipeline, "connections", &connections);
+  if (err) {
+    AFB_API_ERROR(api, "ReadOneLink: fail to parse link JSON : (%s)",
+                  json_object_to_json_string(linkJ));
+    goto OnErrorExit;
+  }
+  connection->pipeline = pipeline > 0 ? pipeline : 0;
+  connection->connections = connections > 0 ? connections : 0;
+
+  for (registered = controller->registry; registered; registered = registered->registered) {
+    if (registered->uid && !strcmp(registered->uid, uid)) {
+      AFB_API_ERROR(api, "ReadOneLink: duplicate link uid=%s", uid);
+      goto OnErrorExit;
+    }
+  }
+
+  // the global URI may be named by a link, two links cannot share one
+  err = ModbusRegisterConnection(api, controller, &connection, uid);
+  if (err)
+    goto OnErrorExit;
+  if (connection->uid) {
+    AFB_API_ERROR(api, "ReadOneLink: link uid=%s uses the uri of link=%s",
+                  uid, connection->uid);
+    return -1;
+  }
+  connection->uid = uid;
+
+  // every link gets its own I/O thread, links are polled in parallel
+  connection->autostart = 2;
+  return 0;
+
+OnErrorExit:
+  free(connection);
+  return -1;
+}
+
+static int ReadLinks(afb_api_t api, CtlHandleT *controller,
+                     json_object *configJ, char *key) {
+  json_object *linksJ = json_object_object_get(configJ, key);
+  int err;
+
+  if (!linksJ)
+    return 0;
+
+  if (json_object_is_type(linksJ, json_type_array)) {
+    for (int idx = 0; idx < (int)json_object_array_length(linksJ); idx++) {
+      err = ReadOneLink(api, controller, json_object_array_get_idx(linksJ, idx));
+      if (err)
+        return -1;
+    }
+    return 0;
+  }
+  return ReadOneLink(api, controller, linksJ);
+}
+
 static int ReadGlobalUri(afb_api_t api, CtlHandleT *controller,
                              json_object *configJ, char *key) {
   int err;
   char *global_uri;
+  int pipeline = 0, connections = 0;
   bool key_not_found;
   ModbusConnectionT *connection;
 
-  err = rp_jsonc_unpack(configJ, "{s:s}", "uri", &global_uri);
+  err = rp_jsonc_unpack(configJ, "{s:s s?i s?i}", "uri", &global_uri, "pipeline", &pipeline,
+                        "connections", &connections);
   key_not_found = !strcmp(rp_jsonc_get_error_string(err), "key not found");
   if (err && !key_not_found) {
     AFB_API_ERROR(api, "ReadGlobalUri: failed to parse global URI in config");
@@ -544,31 +833,202 @@ static int ReadGlobalUri(afb_api_t api, CtlHandleT *controller,
       goto OnErrorExit;
     }
     connection->uri = global_uri;
+    connection->pipeline = pipeline > 0 ? pipeline : 0;
+    connection->connections = connections > 0 ? connections : 0;
 
-    connection->semaphore = malloc(sizeof(sem_t));
-    if (!connection->semaphore) {
-      AFB_API_ERROR(api, "ReadGlobalUri: out of memory");
+    // RTUs declaring the global URI again share this link
+    err = ModbusRegisterConnection(api, controller, &connection, "");
+    if (err)
       goto OnErrorExit;
+
+    // connected with every other link once the config is loaded
+    connection->autostart = 2;
+    controller->connection = connection;
+  }
+
+  return 0;
+
+OnErrorExit:
+  return -1;
+}
+
+// links connected at once at startup
+#ifndef MB_CONNECT_PARALLEL
+#define MB_CONNECT_PARALLEL 16
+#endif
+
+// time (ms) startup waits for links, slower ones are connected lazily
+#ifndef MB_STARTUP_TIMEOUT_MS
+#define MB_STARTUP_TIMEOUT_MS 5000
+#endif
+
+// first and largest delay between two background connect attempts
+#ifndef MB_CONNECT_RETRY_MIN_MS
+#define MB_CONNECT_RETRY_MIN_MS 1000
+#endif
+#ifndef MB_CONNECT_RETRY_MAX_MS
+#define MB_CONNECT_RETRY_MAX_MS 60000
+#endif
+
+typedef struct {
+  afb_api_t api;
+  CtlHandleT *controller;
+  ModbusConnectionT *connection;
+} ModbusConnectJobT;
+
+// connect threads may outlive the startup wait
+static pthread_mutex_t StartupMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t StartupCond = PTHREAD_COND_INITIALIZER;
+static uint StartupPending;  // links without a first connect result
+static sem_t StartupSlots;   // bounds concurrent connect attempts
+
+// connect one link, optional links are retried in the background
+static void *ModbusConnectThread(void *arg) {
+  ModbusConnectJobT *job = (ModbusConnectJobT *)arg;
+  ModbusConnectionT *connection = job->connection;
+  const char *uid = connection->uid ? connection->uid : connection->uri;
+  uint backoff = 0, delay;
+  bool first = true;
+  int err;
+
+  for (;;) {
+    sem_wait(&StartupSlots);
+    err = ModbusRtuConnect(job->api, connection, uid);
+    sem_post(&StartupSlots);
+
+    if (first) {
+      pthread_mutex_lock(&StartupMutex);
+      StartupPending--;
+      pthread_cond_broadcast(&StartupCond);
+      pthread_mutex_unlock(&StartupMutex);
+      first = false;
     }
-    err = sem_init(connection->semaphore, 0, 1);
-    if (err < 0) {
-      AFB_API_ERROR(api, "ReadGlobalUri: failed to init semaphore");
-      goto OnErrorExit;
+    if (!err || connection->autostart > 1)
+      break;
+
+    backoff = backoff ? backoff * 2 : MB_CONNECT_RETRY_MIN_MS;
+    if (backoff > MB_CONNECT_RETRY_MAX_MS)
+      backoff = MB_CONNECT_RETRY_MAX_MS;
+    delay = backoff / 2 + random() % (backoff / 2 + 1);
+    AFB_API_NOTICE(job->api, "ModbusConnectThread: uid=%s uri=%s unreachable, retry in %dms",
+                   uid, connection->uri, delay);
+    usleep(delay * 1000);
+
+    // admin disconnected the link meanwhile, it decides from now on
+    if (atomic_load(&connection->abandoned)) {
+      AFB_API_NOTICE(job->api, "ModbusConnectThread: uid=%s uri=%s retry abandoned",
+                     uid, connection->uri);
+      break;
+    }
+  }
+
+  // admin disconnect raced with the attempt that succeeded
+  if (!err && atomic_load(&connection->abandoned)) {
+    ModbusRtuDisconnect(job->api, connection);
+    err = -1;
+  }
+
+  if (!err) {
+    AFB_API_NOTICE(job->api, "ModbusConnectThread: uid=%s uri=%s connected", uid, connection->uri);
+    // blocks were planned at load time, before the round trip was known
+    for (int idx = 0; job->controller->modbus && job->controller->modbus[idx].uid; idx++) {
+      ModbusRtuT *rtu = &job->controller->modbus[idx];
+      if (rtu->connection == connection && ModbusRtuReplanBlocks(job->api, rtu))
+        AFB_API_ERROR(job->api, "ModbusConnectThread: fail to replan uid=%s", rtu->uid);
     }
+  }
+  atomic_store_explicit(&connection->connecting, false, memory_order_release);
+  free(job);
+  return NULL;
+}
+
+/**
+ * Connect every registered link concurrently
+ *
+ * Startup waits at most 'startup_timeout' ms (global config). Mandatory
+ * links (global URI, named links, RTUs with autostart 2) must be connected
+ * by then. Other links keep connecting in the background and their RTUs
+ * answer "not connected" until they are.
+ *
+ * @return 0 = OK, -1 = a mandatory link is not connected
+ */
+static int ModbusConnectAll(afb_api_t api, CtlHandleT *controller) {
+  ModbusConnectionT *connection;
+  ModbusConnectJobT *job;
+  pthread_t thread;
+  struct timespec deadline;
+  int timeout = MB_STARTUP_TIMEOUT_MS;
+  int err;
 
-    err = ModbusRtuConnect(api, connection, "");
+  err = rp_jsonc_unpack(controller->config, "{s?i}", "startup_timeout", &timeout);
+  if (err || timeout <= 0)
+    timeout = MB_STARTUP_TIMEOUT_MS;
+
+  sem_init(&StartupSlots, 0, MB_CONNECT_PARALLEL);
+  for (connection = controller->registry; connection; connection = connection->registered) {
+    if (!connection->autostart || connection->context)
+      continue;
+    job = (ModbusConnectJobT *)calloc(1, sizeof(ModbusConnectJobT));
+    if (!job) {
+      AFB_API_ERROR(api, "ModbusConnectAll: out of memory");
+      return -1;
+    }
+    job->api = api;
+    job->controller = controller;
+    job->connection = connection;
+    atomic_store(&connection->connecting, true);
+
+    pthread_mutex_lock(&StartupMutex);
+    StartupPending++;
+    pthread_mutex_unlock(&StartupMutex);
+    err = pthread_create(&thread, NULL, ModbusConnectThread, job);
     if (err) {
-      AFB_API_ERROR(api, "ReadGlobalUri: fail to connect uri=%s", connection->uri);
-      goto OnErrorExit;
+      AFB_API_ERROR(api, "ModbusConnectAll: fail to start connect thread uri=%s",
+                    connection->uri);
+      return -1;
     }
+    pthread_detach(thread);
+  }
 
-    controller->connection = connection;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += (timeout % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+  pthread_mutex_lock(&StartupMutex);
+  while (StartupPending) {
+    if (pthread_cond_timedwait(&StartupCond, &StartupMutex, &deadline) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&StartupMutex);
+
+  for (connection = controller->registry; connection; connection = connection->registered) {
+    if (!connection->autostart || connection->context)
+      continue;
+    if (connection->autostart > 1) {
+      AFB_API_ERROR(api, "ModbusConnectAll: mandatory uri=%s not connected within %dms",
+                    connection->uri, timeout);
+      return -1;
+    }
+    AFB_API_NOTICE(api, "ModbusConnectAll: uri=%s connects in background", connection->uri);
   }
 
+  // slave settings of RTUs whose link is already up
+  for (int idx = 0; controller->modbus && controller->modbus[idx].uid; idx++) {
+    ModbusRtuT *rtu = &controller->modbus[idx];
+    if (!rtu->connection->context)
+      continue;
+    err = ModbusRtuSetSlave(api, rtu);
+    if (err) {
+      AFB_API_ERROR(api, "ModbusConnectAll: failed to set slave ID uid=%s uri=%s",
+                    rtu->uid, rtu->connection->uri);
+      if (rtu->autostart > 1)
+        return -1;
+    }
+  }
   return 0;
-
-OnErrorExit:
-  return -1;
 }
 
 // main binding entry
@@ -607,6 +1067,12 @@ int AfbApiCtrlCb(afb_api_t rootapi, afb_ctlid_t ctlid, afb_ctlarg_t ctlarg,
       goto OnErrorExit;
     }
 
+    status = ReadLinks(rootapi, controller, controller->config, "links");
+    if (status < 0) {
+      AFB_API_ERROR(rootapi, "Modbus failed to setup named links");
+      goto OnErrorExit;
+    }
+
     // load api (dependencies+verb+event creation)
     status = ReadModbusSection(rootapi, controller, controller->config,
                                "modbus");
@@ -615,10 +1081,22 @@ int AfbApiCtrlCb(afb_api_t rootapi, afb_ctlid_t ctlid, afb_ctlarg_t ctlarg,
                     "Modbus fail api controller config initialization\n");
       goto OnErrorExit;
     }
+
+    status = ModbusConnectAll(rootapi, controller);
+    if (status < 0) {
+      AFB_API_ERROR(rootapi, "Modbus fail to connect mandatory links");
+      goto OnErrorExit;
+    }
     break;
 
   /** called for init */
   case afb_ctlid_Init:
+    // gateway mode, other masters read the values polled by the binding
+    status = ModbusServerStart(rootapi, controller);
+    if (status < 0) {
+      AFB_API_ERROR(rootapi, "Modbus fail to start Modbus/TCP server");
+      goto OnErrorExit;
+    }
     break;
 
   /** called when required classes are ready */
@@ -25,8 +25,9 @@
 #ifndef _MODBUS_BINDING_INCLUDE_
 #define _MODBUS_BINDING_INCLUDE_
 
-// added semaphore to prevent multiple read on the same RS485
-#include <semaphore.h>
+// one I/O thread per connection prevents multiple transactions on the same RS485/socket
+#include <pthread.h>
+#include <stdatomic.h>
 
 // usefull classical include
 #include <stdio.h>
@@ -53,6 +54,15 @@ typedef struct  {
   const char *info;
 } StaticVerbsT;
 
+// bus access classes, lower value is served first
+typedef enum {
+  MB_CLASS_WRITE=0,     // writes from API verbs
+  MB_CLASS_READ,        // on-demand reads from API verbs
+  MB_CLASS_POLL,        // periodic subscription polling
+  MB_CLASS_DIAG,        // admin probes (RTU status)
+  MB_CLASS_COUNT
+} ModbusClassE;
+
 typedef enum {
   MB_TYPE_UNSET=0,      // Null is not a valid default
   MB_COIL_STATUS,       // Func Code Read=01 WriteSingle=05 WriteMultiple=15
@@ -68,6 +78,44 @@ typedef struct ModbusRtuS ModbusRtuT;
 typedef struct ModbusConnectionS ModbusConnectionT;
 typedef struct ModbusEncoderCbS ModbusFormatCbT;
 typedef struct ModbusSourceS ModbusSourceT;
+typedef struct ModbusBlockS ModbusBlockT;
+typedef struct ModbusSchedulerS ModbusSchedulerT;
+typedef struct ModbusEvtS ModbusEvtT;
+typedef struct ModbusChannelS ModbusChannelT;
+typedef struct ModbusWorkerS ModbusWorkerT;
+typedef struct ModbusXferS ModbusXferT;
+typedef struct ModbusTcpS ModbusTcpT;
+
+// native Modbus/TCP completion, error is 0 or an errno (device exceptions
+// use libmodbus EMBX* values), pdu is the response without MBAP header
+typedef void (*ModbusTcpCbT)(void *closure, int error, const uint8_t *pdu, uint len);
+
+// raw coil/register write forwarded by the Modbus/TCP server
+typedef struct {
+  afb_api_t api;
+  ModbusTypeE type;     // MB_COIL_STATUS or MB_REGISTER_HOLDING
+  uint registry;
+  uint count;
+  bool single;          // function 05/06 rather than 15/16
+  uint16_t registers[123];  // MODBUS_MAX_WRITE_REGISTERS
+  uint8_t bits[1968];       // MODBUS_MAX_WRITE_BITS, one byte per coil
+} ModbusRawWriteT;
+
+// one bus transaction executed by the connection I/O thread
+struct ModbusXferS {
+  ModbusClassE class;
+  uint64_t deadline;    // monotonic time (ms), orders transactions of a class
+  uint64_t expire;      // monotonic time (ms) after which it is dropped, 0 = never
+  int (*runCB)(ModbusXferT *xfer);   // I/O thread, bus owned
+  void (*doneCB)(ModbusXferT *xfer); // afb job, NULL for synchronous callers
+  void *context;
+  void *data;
+  ModbusConnectionT *link;  // pool socket running it, NULL = least loaded
+  int status;           // runCB result
+  int error;            // errno after runCB
+  bool completed;
+  ModbusXferT *next;    // I/O thread private queues
+};
 
 struct ModbusEncoderCbS {
   const char *uid;
@@ -85,13 +133,86 @@ struct ModbusSourceS {
   void *context;
 };
 
+// link health, reconnects run on the I/O thread with a jittered backoff
+typedef enum {
+  MB_LINK_DOWN = 0,      // not connected, no automatic retry
+  MB_LINK_CONNECTED,
+  MB_LINK_DEGRADED,      // last transactions timed out, link still used
+  MB_LINK_RECONNECTING,  // transactions fail fast until a retry succeeds
+} ModbusLinkStateE;
+
 struct ModbusConnectionS {
+  const char *uid;             // name of a declared link, NULL otherwise
   void *context;
-  sem_t *semaphore;
+  ModbusWorkerT *worker;       // I/O thread, the only one using context
+  ModbusTcpT *tcp;             // native engine for asynchronous reads, NULL when off
+  uint pipeline;               // max outstanding native requests, 0 = libmodbus only
   const char *uri;
-  bool timed_out;
+  // link health is updated by every thread completing a transaction
+  atomic_bool timed_out;
+  _Atomic ModbusLinkStateE state;
+  atomic_uint timeouts;        // consecutive transactions timed out
+  atomic_uint backoff;         // current reconnect delay (ms)
+  ModbusXferT reconnect;       // background reconnect, one in flight at most
+  int baud;      // serial link speed, 0 on TCP links
+  uint rtt;      // TCP round trip (us) measured at connect time
+  ModbusSchedulerT *scheduler;  // periodic reads of every RTU on this link
+  uint connections;             // TCP sockets opened to the gateway, pool head only
+  ModbusConnectionT *next;      // next socket of the same pool
+  uint autostart;               // highest autostart of its RTUs, 2 = mandatory
+  // set while a connect runs, cleared with release once blocks are replanned
+  atomic_bool connecting;
+  atomic_bool abandoned;        // admin disconnect, a running connect gives up
+  char *key;                    // normalized URI, shared connections only
+  char *adminuri;               // URI given to the admin connect action, private links only
+  ModbusConnectionT *registered;  // next link of the loader registry
 };
 
+// registers/coils an RTU must never be asked for by a block read
+typedef struct {
+  ModbusFunctionCbT *function;  // NULL applies to every register type
+  uint registry;
+  uint count;                   // 0 terminates the list
+} ModbusRangeT;
+
+// response times kept per RTU and function to derive the timeout
+#ifndef MB_LATENCY_SAMPLES
+#define MB_LATENCY_SAMPLES 128
+#endif
+
+// latency slots: writes, then reads indexed by ModbusTypeE
+#define MB_LATENCY_WRITE 0
+#define MB_LATENCY_SLOTS (MB_REGISTER_HOLDING + 1)
+
+// rolling response time distribution of one RTU function
+typedef struct {
+  uint samples[MB_LATENCY_SAMPLES];  // response times (us), ring buffer
+  uint count;    // samples recorded, saturates at MB_LATENCY_SAMPLES
+  uint next;
+  uint p99;      // 99th percentile (us)
+  uint timeout;  // learned response timeout (ms), 0 until enough samples
+} ModbusLatencyT;
+
+// register image slots, indexed by ModbusTypeE
+#define MB_IMAGE_SLOTS (MB_REGISTER_HOLDING + 1)
+
+// RTU shadow image of one register type, blocks are laid out back to back
+// in address order. Coils take one byte each, in words sized per coil.
+typedef struct {
+  uint16_t *raw;       // block receive buffers
+  uint16_t *current;   // last good value of every sensor, one slot each
+  uint16_t *previous;  // values before the last read, same layout
+  uint size;           // words of the raw image
+  uint values;         // words of the current and previous images
+} ModbusImageT;
+
+// per RTU circuit breaker, a silent slave stops consuming bus time
+typedef enum {
+  MB_BREAKER_CLOSED = 0,  // normal traffic
+  MB_BREAKER_OPEN,        // polls suspended, reads answered from cache
+  MB_BREAKER_PROBING,     // one poll in flight to check the slave is back
+} ModbusBreakerStateE;
+
 struct ModbusRtuS {
   const char *uid;
   const char *info;
@@ -101,14 +222,39 @@ struct ModbusRtuS {
   const int timeout;
   const int idle;
   const int slaveid;
+  int unit;     // unit id served by the Modbus/TCP server, <0 = slaveid
   const int debug;
   uint period;  // default polling period when subscribing to sensors
   const uint autostart;  // 0=no 1=try 2=mandatory
+  int maxgap;  // largest hole bridged by a block read, <0 = cost model only
+  ModbusRangeT *noread;  // holes rejected by the device
+  uint maxregs;  // largest register read accepted, learned from exceptions
+  uint maxbits;  // largest coil read accepted, learned from exceptions
+  int breaker;   // consecutive timeouts opening the breaker, 0 = never
+  int probe;     // delay (ms) between two probes of an open breaker
+  pthread_mutex_t mutex;  // breaker state and latency window
+  ModbusBreakerStateE breakerstate;
+  uint failures;     // consecutive timeouts
+  uint trips;        // number of times the breaker opened
+  uint64_t probeat;  // monotonic time (ms) of next probe
+  bool autotimeout;      // response timeout learned from measured latency
+  int timeoutmin;        // lower bound (ms) of the learned timeout
+  double timeoutfactor;  // learned timeout = p99 x factor
+  ModbusLatencyT latency[MB_LATENCY_SLOTS];
+  ModbusImageT images[MB_IMAGE_SLOTS];  // one allocation per register type
   ModbusConnectionT *connection;
 
   ModbusSensorT *sensors;
+  ModbusBlockT *blocks;  // read plan, NULL function terminated
 };
 
+// quality of the last value kept in a sensor buffer
+typedef enum {
+  MB_QUALITY_NONE = 0,  // never read
+  MB_QUALITY_GOOD,      // last read succeeded
+  MB_QUALITY_STALE,     // last read failed, buffer holds an older value
+} ModbusQualityE;
+
 struct ModbusSensorS {
   const char *uid;
   const char *info;
@@ -119,13 +265,22 @@ struct ModbusSensorS {
   uint count;
   uint period;
   uint idle;
-  uint16_t *buffer;
+  double deadband;      // minimum change of a decoded value to send an event
+  bool deadbandpct;     // deadband is a percentage of the last sent value
+  double hysteresis;    // extra change needed when a value turns back
+  bool delta;           // events carry changed elements only
+  uint snapshot;        // delta events between two full snapshots
+  uint16_t *buffer;     // last raw registers read, slot of the RTU image
+  uint16_t *previous;   // raw registers before the last read
+  uint64_t stamp;       // monotonic time (ms) buffer was read, 0 = invalid
+  uint64_t prevstamp;   // monotonic time (ms) previous was read
+  ModbusQualityE quality;
   ModbusFormatCbT *format;
   ModbusFunctionCbT *function;
   ModbusRtuT *rtu;
-  afb_timer_t timer;
+  ModbusBlockT *block;
   afb_api_t api;
-  afb_event_t event;
+  ModbusEvtT *poll;     // subscriptions polling, NULL when not subscribed
   void *context;
 };
 
@@ -133,17 +288,87 @@ struct ModbusFunctionCbS {
   const char *uid;
   const char *info;
   ModbusTypeE type;
+  // blocking calls for plugins running off the binder threads; verbs only
+  // test them to know if the function reads/writes and go asynchronous
   int (*readCB) (ModbusSensorT *sensor, json_object **outputJ);
   int (*writeCB)(ModbusSensorT *sensor, json_object *inputJ);
   int (*WReadCB)(ModbusSensorT *sensor, json_object *inputJ, json_object **outputJ);
 } ;
 
-typedef struct {
-  uint16_t *buffer;
-  uint count;
+// one event channel of a subscribed sensor, shared by every subscriber
+// asking for the same period and filters
+struct ModbusChannelS {
+  afb_event_t event;
+  char *name;
+  uint period;          // event period requested by subscribers (ms)
+  double deadband;      // minimum change of a decoded value to send an event
+  bool deadbandpct;     // deadband is a percentage of the last sent value
+  double hysteresis;    // extra change needed when a value turns back
+  double maxrate;       // maximum events per second, 0 = unlimited
   int idle;
+  uint64_t checked;     // monotonic time (ms) of last change detection
+  uint64_t pushed;      // monotonic time (ms) of last event
+  bool probe;           // push a snapshot to check for remaining subscribers
+  bool settled;         // last check found nothing to send
+  uint16_t *buffer;     // raw values last sent
+  double *values;       // decoded values last sent, deadband/hysteresis only
+  int8_t *trends;       // direction of the last sent change of each value
+  bool *changed;        // elements changed since last event, delta mode only
+  uint deltas;          // delta events sent since last full snapshot
+  ModbusChannelT *next;
+};
+
+// one subscribed sensor, polled by its connection scheduler at the fastest
+// period of its channels
+struct ModbusEvtS {
   ModbusSensorT *sensor;
-} ModbusEvtT;
+  pthread_mutex_t mutex; // protects channels
+  ModbusChannelT *channels;
+  uint period;          // polling period (ms)
+  uint64_t deadline;    // monotonic time (ms) of next poll
+  uint phase;           // offset (ms) of polls within the period
+  uint slot;            // expected transaction time (us)
+  bool replace;         // period changed, phase must be computed again
+  uint placed;          // period the phase was computed for
+  ModbusXferT xfer;     // bus read, one in flight at most
+  ModbusEvtT *sibling;  // next poll of the scheduler, queued or in flight
+  uint missed;          // deadlines missed since subscription
+  ModbusEvtT *next;     // scheduler list, sorted by deadline
+};
+
+// serializes every periodic read of one connection, earliest deadline first
+struct ModbusSchedulerS {
+  afb_api_t api;
+  ModbusConnectionT *connection;
+  pthread_mutex_t mutex;
+  ModbusEvtT *polls;    // sorted by deadline
+  ModbusEvtT *scheduled;  // every poll, queued or in flight
+  void *pending;        // wakeup job currently posted, NULL when idle
+  uint64_t wakeup;      // monotonic time (ms) of the pending wakeup
+  uint64_t epoch;       // origin (ms) of every poll phase
+  uint missed;          // deadlines missed by every poll of the link
+};
+
+// contiguous registers/coils of one RTU fetched with a single transaction
+struct ModbusBlockS {
+  ModbusFunctionCbT *function;
+  uint registry;            // first register/coil of the block
+  uint count;               // number of registers/coils read at once
+  uint16_t *buffer;         // raw block data (coils are stored as bytes)
+  uint offset;              // first word of the block in the RTU raw image
+  ModbusSensorT **sensors;  // member sensors, NULL terminated
+  uint nsensors;
+  ModbusRangeT *chunks;     // split map, one modbus transaction per chunk
+  uint nchunks;
+  _Atomic uint64_t stamp;   // monotonic time (ms) of last successful read
+  pthread_mutex_t mutex;    // split map, pool sockets may read the block at once
+  pthread_mutex_t cache;    // member buffers, stamps, qualities and flight
+  ModbusXferT flight;       // block read shared by concurrent readers
+  bool flying;              // flight queued or on the bus
+  uint64_t launched;        // monotonic time (ms) the flight was queued
+  ModbusXferT *waiters;     // reads completed by the flight, FIFO
+  ModbusXferT **waitail;
+};
 
 
 typedef struct {
@@ -168,16 +393,74 @@ typedef struct {
   /** default modbus connection */
   ModbusConnectionT *connection;
 
+  /** links shared by RTUs declaring the same URI */
+  ModbusConnectionT *registry;
+
 } CtlHandleT;
 
+// modbus-binding.c
+int ParsePollingPeriod (afb_api_t api, json_object *config, uint *period);
+int ParseDeadband (afb_api_t api, json_object *deadbandJ, double *deadband, bool *percent);
+
 // modbus-glue.c
 void ModbusSensorRequest (afb_req_t request, ModbusSensorT *sensor, json_object *queryJ);
 void ModbusRtuRequest (afb_req_t request, ModbusRtuT *rtu, json_object *queryJ);
 int ModbusRtuConnect(afb_api_t api, ModbusConnectionT *connection, const char *rtu_uid);
+void ModbusRtuDisconnect(afb_api_t api, ModbusConnectionT *connection);
 int ModbusRtuSetSlave(afb_api_t api, ModbusRtuT *rtu);
-int ModbusRtuIsConnected (afb_api_t api, ModbusRtuT *rtu);
+bool ModbusRtuIsOnline (ModbusRtuT *rtu);
 ModbusFunctionCbT * mbFunctionFind (afb_api_t api, const char *uri);
 void ModbusRtuSensorsId (ModbusRtuT *rtu, int verbose, json_object *responseJ);
+int ModbusConnectionBaud (ModbusConnectionT *connection);
+char *ModbusNormalizeURI (const char *uri);
+int ModbusParseURI (const char *uri, char **host, int *port);
+int ModbusRawWriteRun (ModbusXferT *xfer);
+int ModbusSensorReadRun (ModbusXferT *xfer);
+int ModbusSensorReadSubmit (ModbusSensorT *sensor, ModbusXferT *xfer);
+bool ModbusLinkUsable (ModbusConnectionT *link);
+const char *ModbusLinkStateName (ModbusConnectionT *link);
+void ModbusSensorPoll (ModbusEvtT *poll);
+json_object *ModbusRtuBreakerInfo (ModbusRtuT *rtu);
+json_object *ModbusRtuLatencyInfo (ModbusRtuT *rtu);
+uint64_t ModbusNowMs (void);
+uint64_t ModbusNowUs (void);
+
+// modbus-scheduler.c
+int ModbusSchedulerAdd (afb_api_t api, ModbusConnectionT *connection, ModbusEvtT *poll);
+json_object *ModbusSchedulerInfo (ModbusConnectionT *connection, ModbusRtuT *rtu);
+void ModbusSchedulerRequeue (ModbusConnectionT *connection, ModbusEvtT *poll);
+void ModbusSchedulerUpdate (ModbusConnectionT *connection, ModbusEvtT *poll);
+void ModbusSchedulerRemove (ModbusConnectionT *connection, ModbusEvtT *poll);
+
+// modbus-worker.c
+ModbusWorkerT *ModbusWorkerStart (afb_api_t api, ModbusConnectionT *connection);
+int ModbusXferSubmit (ModbusConnectionT *connection, ModbusXferT *xfer);
+int ModbusXferRun (ModbusConnectionT *connection, ModbusXferT *xfer);
+json_object *ModbusConnectionQueues (ModbusConnectionT *connection);
+ModbusConnectionT *ModbusConnectionPick (ModbusConnectionT *connection);
+
+// modbus-tcp.c
+ModbusTcpT *ModbusTcpCreate (afb_api_t api, ModbusConnectionT *connection,
+                             const char *host, int port, uint pipeline);
+int ModbusTcpSend (ModbusTcpT *tcp, uint8_t unit, const uint8_t *pdu, uint len,
+                   uint timeout, ModbusTcpCbT callback, void *closure);
+uint ModbusTcpOutstanding (ModbusTcpT *tcp);
+int ModbusTcpReopen (ModbusTcpT *tcp);
+void ModbusTcpClose (ModbusTcpT *tcp);
+int ModbusTcpTarget (ModbusTcpT *tcp, const char *host, int port);
+
+// modbus-resolver.c
+int ModbusTcpConnect (afb_api_t api, const char *host, int port, uint *rtt);
+
+// modbus-server.c
+int ModbusServerStart (afb_api_t api, CtlHandleT *controller);
+
+// modbus-planner.c
+int ModbusRtuPlanBlocks(afb_api_t api, ModbusRtuT *rtu);
+int ModbusRtuReplanBlocks(afb_api_t api, ModbusRtuT *rtu);
+uint ModbusSensorSpan(ModbusSensorT *sensor);
+uint ModbusSensorBytes(ModbusSensorT *sensor);
+uint ModbusBlockCostUs(ModbusRtuT *rtu, ModbusBlockT *block);
 
 // modbus-encoder.c
 ModbusFormatCbT *mbEncoderFind (afb_api_t api, const char *uri) ;
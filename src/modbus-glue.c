@@ -25,13 +25,16 @@
 
 #include "modbus-binding.h"
 #include <afb-req-utils.h>
-#include <arpa/inet.h>
+#include <ctype.h>
 #include <errno.h>
 #include <modbus/modbus.h>
-#include <netdb.h>
 #include <sys/socket.h>
 #include <unistd.h>
 #include <sys/file.h>
+#include <time.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
 
 static int ModbusFormatResponse(ModbusSensorT *sensor,
                                 json_object **responseJ) {
@@ -72,25 +75,460 @@ OnErrorExit:
   return 1;
 }
 
-// try to reconnect when RTU close connection
-static void ModbusReconnect(ModbusSensorT *sensor) {
-  modbus_t *ctx = (modbus_t *)sensor->rtu->connection->context;
-  AFB_API_NOTICE(sensor->api, "ModbusReconnect: Try reconnecting rtu=%s",
-                 sensor->rtu->uid);
+// delta event: {"index": [changed indexes], "value": [their new values]}
+static int ModbusFormatDelta(ModbusSensorT *sensor, bool *changed,
+                             json_object **responseJ) {
+  ModbusFormatCbT *format = sensor->format;
+  json_object *indexJ, *valueJ, *elemJ;
+  ModbusSourceT source;
+  int err;
+
+  if (!format->decodeCB) {
+    AFB_API_NOTICE(sensor->api, "ModbusFormatDelta: No decodeCB uid=%s",
+                   sensor->uid);
+    goto OnErrorExit;
+  }
+
+  source.sensor = sensor->uid;
+  source.api = sensor->api;
+  source.context = sensor->context;
+
+  indexJ = json_object_new_array();
+  valueJ = json_object_new_array();
+  for (uint idx = 0; idx < sensor->count; idx++) {
+    if (!changed[idx])
+      continue;
+    err = format->decodeCB(&source, format, (uint16_t *)sensor->buffer, idx, &elemJ);
+    if (err) {
+      json_object_put(indexJ);
+      json_object_put(valueJ);
+      goto OnErrorExit;
+    }
+    json_object_array_add(indexJ, json_object_new_int(idx));
+    json_object_array_add(valueJ, elemJ);
+  }
+  rp_jsonc_pack(responseJ, "{so so}", "index", indexJ, "value", valueJ);
+  return 0;
+
+OnErrorExit:
+  return 1;
+}
+
+// first and largest delay between two reconnect attempts
+#ifndef MB_RECONNECT_MIN_MS
+#define MB_RECONNECT_MIN_MS 500
+#endif
+#ifndef MB_RECONNECT_MAX_MS
+#define MB_RECONNECT_MAX_MS 30000
+#endif
+
+// consecutive timeouts after which a TCP socket is considered dead
+#ifndef MB_LINK_MAX_TIMEOUTS
+#define MB_LINK_MAX_TIMEOUTS 3
+#endif
 
-  // force deconnection/reconnection
+static const char *ModbusLinkStateNames[] = {"down", "connected", "degraded", "reconnecting"};
+
+const char *ModbusLinkStateName(ModbusConnectionT *link) {
+  return ModbusLinkStateNames[link->state];
+}
+
+// transactions other than diagnostics are only sent on a live link
+bool ModbusLinkUsable(ModbusConnectionT *link) {
+  return link->state == MB_LINK_CONNECTED || link->state == MB_LINK_DEGRADED;
+}
+
+static void ModbusLinkRetry(int signum, void *arg);
+
+/**
+ * Connect a libmodbus TCP context to its gateway
+ *
+ * The socket is opened by ModbusTcpConnect (cached resolution, IPv6,
+ * fallback across addresses) then handed to libmodbus. The handshake
+ * round trip is kept to cost block reads.
+ *
+ * @return 0 when connected, -1 with errno set otherwise
+ */
+static int ModbusLinkOpenTcp(afb_api_t api, ModbusConnectionT *link, modbus_t *ctx) {
+  char *host;
+  int port, fd;
+  uint rtt = 0;
+
+  if (ModbusParseURI(link->uri, &host, &port)) {
+    errno = EINVAL;
+    return -1;
+  }
+  fd = ModbusTcpConnect(api, host, port, &rtt);
+  free(host);
+  if (fd < 0)
+    return -1;
+
+  modbus_set_socket(ctx, fd);
+  link->rtt = rtt;
+  return 0;
+}
+
+// I/O thread side of a reconnect, the context is only touched here
+static int ModbusLinkReconnectRun(ModbusXferT *xfer) {
+  ModbusConnectionT *link = xfer->link;
+  modbus_t *ctx = (modbus_t *)link->context;
+
+  if (!ctx) {
+    errno = ENOTCONN;
+    return -1;
+  }
   modbus_close(ctx);
-  int err = modbus_connect(ctx);
-  if (err) {
-    AFB_API_ERROR(sensor->api,
-                  "ModbusReconnect: Socket disconnected rtu=%s error=%s",
-                  sensor->rtu->uid, strerror(err));
+  if (link->baud ? modbus_connect(ctx) == -1
+                 : ModbusLinkOpenTcp((afb_api_t)xfer->context, link, ctx))
+    return -1;
+  if (link->tcp && ModbusTcpReopen(link->tcp))
+    return -1;
+  return 0;
+}
+
+// reconnect outcome, the api used for logging travels in xfer->context
+static void ModbusLinkReconnectDone(ModbusXferT *xfer) {
+  ModbusConnectionT *link = xfer->link;
+  uint delay;
+
+  ModbusLinkStateE state = MB_LINK_RECONNECTING;
+
+  // disconnected by admin meanwhile
+  if (link->state != MB_LINK_RECONNECTING)
+    return;
+
+  if (!xfer->status) {
+    link->timed_out = false;
+    link->timeouts = 0;
+    link->backoff = 0;
+    if (!atomic_compare_exchange_strong(&link->state, &state, MB_LINK_CONNECTED))
+      return;
+    AFB_API_NOTICE((afb_api_t)xfer->context, "ModbusLinkReconnect: link back uri=%s",
+                   link->uri);
+    return;
+  }
+
+  // exponential backoff, jitter spreads the retries of every link
+  link->backoff = link->backoff ? link->backoff * 2 : MB_RECONNECT_MIN_MS;
+  if (link->backoff > MB_RECONNECT_MAX_MS)
+    link->backoff = MB_RECONNECT_MAX_MS;
+  delay = link->backoff / 2 + random() % (link->backoff / 2 + 1);
+  AFB_API_WARNING((afb_api_t)xfer->context,
+                  "ModbusLinkReconnect: fail uri=%s error=%s, retry in %dms",
+                  link->uri, modbus_strerror(xfer->error), delay);
+  afb_job_post(delay, 0, ModbusLinkRetry, link, NULL);
+}
+
+static void ModbusLinkRetry(int signum, void *arg) {
+  ModbusConnectionT *link = (ModbusConnectionT *)arg;
+
+  if (signum || link->state != MB_LINK_RECONNECTING)
+    return;
+
+  link->reconnect.class = MB_CLASS_DIAG;
+  link->reconnect.deadline = ModbusNowMs();
+  link->reconnect.runCB = ModbusLinkReconnectRun;
+  link->reconnect.doneCB = ModbusLinkReconnectDone;
+  link->reconnect.link = link;
+  if (ModbusXferSubmit(link, &link->reconnect)) {
+    link->reconnect.status = -1;
+    link->reconnect.error = errno;
+    ModbusLinkReconnectDone(&link->reconnect);
+  }
+}
+
+/**
+ * Account a failed transaction on a link
+ *
+ * Timeouts only degrade the link, a silent device must not close a shared
+ * socket. Transport errors, or repeated timeouts on TCP, move the link to
+ * reconnecting: transactions fail fast while the I/O thread retries in the
+ * background. May be called from any thread.
+ */
+static void ModbusLinkError(afb_api_t api, ModbusConnectionT *link, int error) {
+  ModbusLinkStateE state = MB_LINK_CONNECTED;
+  bool reconnect = false;
+
+  switch (error) {
+  case ETIMEDOUT:
+    link->timed_out = true;
+    reconnect = !link->baud && atomic_fetch_add(&link->timeouts, 1) + 1 >= MB_LINK_MAX_TIMEOUTS;
+    if (!reconnect)
+      atomic_compare_exchange_strong(&link->state, &state, MB_LINK_DEGRADED);
+    break;
+  case ECONNRESET:
+  case ECONNREFUSED:
+  case EPIPE:
+  case EBADF:
+  case EIO:
+    reconnect = true;
+    break;
+  default:
+    // device exceptions and bad frames say nothing about the link
+    break;
+  }
+
+  if (!reconnect)
+    return;
+
+  // only the thread moving the link to reconnecting starts the reconnect
+  do {
+    state = link->state;
+    if (state != MB_LINK_CONNECTED && state != MB_LINK_DEGRADED)
+      return;
+  } while (!atomic_compare_exchange_weak(&link->state, &state, MB_LINK_RECONNECTING));
+
+  AFB_API_NOTICE(api, "ModbusLinkError: link lost uri=%s error=%s, reconnecting",
+                 link->uri, modbus_strerror(error));
+  link->reconnect.context = api;
+  afb_job_post(0, 0, ModbusLinkRetry, link, NULL);
+}
+
+// a transaction went through, the link is healthy
+static void ModbusLinkOk(ModbusConnectionT *link) {
+  ModbusLinkStateE state = MB_LINK_DEGRADED;
+
+  link->timeouts = 0;
+  atomic_compare_exchange_strong(&link->state, &state, MB_LINK_CONNECTED);
+}
+
+// samples needed before the learned timeout replaces the configured one
+#ifndef MB_LATENCY_MIN_SAMPLES
+#define MB_LATENCY_MIN_SAMPLES 16
+#endif
+
+// learned timeout is recomputed every MB_LATENCY_REFRESH samples
+#ifndef MB_LATENCY_REFRESH
+#define MB_LATENCY_REFRESH 16
+#endif
+
+// upper bound when the RTU does not configure a timeout (libmodbus default)
+#ifndef MB_LATENCY_MAX_TIMEOUT_MS
+#define MB_LATENCY_MAX_TIMEOUT_MS 500
+#endif
+
+static const char *ModbusLatencyNames[MB_LATENCY_SLOTS] = {
+    "write", "coil_status", "coil_input", "register_input", "register_holding"};
+
+static int ModbusLatencyCompare(const void *a, const void *b) {
+  uint va = *(const uint *)a, vb = *(const uint *)b;
+  return (va > vb) - (va < vb);
+}
+
+/**
+ * Record the response time of one transaction
+ *
+ * Every MB_LATENCY_REFRESH samples, the 99th percentile of the last
+ * MB_LATENCY_SAMPLES answers is computed and the learned timeout becomes
+ * p99 x timeout_factor, clamped between timeout_min and the configured
+ * timeout.
+ */
+static void ModbusLatencyRecord(ModbusRtuT *rtu, uint slot, uint64_t us) {
+  ModbusLatencyT *latency = &rtu->latency[slot];
+  uint sorted[MB_LATENCY_SAMPLES];
+  uint maxtimeout, timeout;
+
+  // pool sockets and the native engine record concurrently
+  pthread_mutex_lock(&rtu->mutex);
+  latency->samples[latency->next] = (uint)us;
+  latency->next = (latency->next + 1) % MB_LATENCY_SAMPLES;
+  if (latency->count < MB_LATENCY_SAMPLES)
+    latency->count++;
+
+  if (latency->count < MB_LATENCY_MIN_SAMPLES || latency->next % MB_LATENCY_REFRESH) {
+    pthread_mutex_unlock(&rtu->mutex);
+    return;
   }
+
+  memcpy(sorted, latency->samples, latency->count * sizeof(uint));
+  qsort(sorted, latency->count, sizeof(uint), ModbusLatencyCompare);
+  latency->p99 = sorted[(latency->count * 99 + 99) / 100 - 1];
+
+  maxtimeout = rtu->timeout ? (uint)rtu->timeout : MB_LATENCY_MAX_TIMEOUT_MS;
+  timeout = (uint)ceil(latency->p99 * rtu->timeoutfactor / 1000.0);
+  if (timeout < (uint)rtu->timeoutmin)
+    timeout = rtu->timeoutmin;
+  if (timeout > maxtimeout)
+    timeout = maxtimeout;
+  latency->timeout = timeout;
+  pthread_mutex_unlock(&rtu->mutex);
 }
 
-static int ModbusRtuSemWait(afb_api_t api, ModbusRtuT *rtu) {
-  if (rtu->connection->semaphore) sem_wait (rtu->connection->semaphore);
-  return ModbusRtuSetSlave(api, rtu);
+// response timeout (ms) of one RTU function, 0 = libmodbus default
+static uint ModbusRtuTimeout(ModbusRtuT *rtu, uint slot) {
+  if (rtu->autotimeout && rtu->latency[slot].timeout)
+    return rtu->latency[slot].timeout;
+  return rtu->timeout;
+}
+
+// set the learned timeout of a function before sending it
+static void ModbusLatencyApply(ModbusRtuT *rtu, modbus_t *ctx, uint slot) {
+  uint timeout = ModbusRtuTimeout(rtu, slot);
+
+  if (rtu->autotimeout && timeout)
+    modbus_set_response_timeout(ctx, timeout / 1000, (timeout % 1000) * 1000);
+}
+
+// measured latencies and learned timeouts reported by the info verb
+json_object *ModbusRtuLatencyInfo(ModbusRtuT *rtu) {
+  json_object *latencyJ = json_object_new_object();
+  json_object *slotJ;
+
+  pthread_mutex_lock(&rtu->mutex);
+  for (uint slot = 0; slot < MB_LATENCY_SLOTS; slot++) {
+    if (!rtu->latency[slot].count)
+      continue;
+    rp_jsonc_pack(&slotJ, "{si si si}", "samples", rtu->latency[slot].count,
+                  "p99_us", rtu->latency[slot].p99, "timeout", ModbusRtuTimeout(rtu, slot));
+    json_object_object_add(latencyJ, ModbusLatencyNames[slot], slotJ);
+  }
+  pthread_mutex_unlock(&rtu->mutex);
+  return latencyJ;
+}
+
+static const char *ModbusBreakerNames[] = {"closed", "open", "probing"};
+
+/**
+ * Check if a transaction may be sent to an RTU
+ *
+ * An open breaker rejects everything until its probe time, then lets one
+ * poll through (probe = true) and waits for its result.
+ */
+static bool ModbusBreakerAllows(ModbusRtuT *rtu, bool probe) {
+  bool allowed = false;
+
+  pthread_mutex_lock(&rtu->mutex);
+  switch (rtu->breakerstate) {
+  case MB_BREAKER_CLOSED:
+    allowed = true;
+    break;
+  case MB_BREAKER_OPEN:
+    // a single poll gets the probe
+    if (probe && ModbusNowMs() >= rtu->probeat) {
+      rtu->breakerstate = MB_BREAKER_PROBING;
+      allowed = true;
+    }
+    break;
+  default:
+    break;
+  }
+  pthread_mutex_unlock(&rtu->mutex);
+  return allowed;
+}
+
+// account the result of a transaction, any answer proves the slave alive
+static void ModbusBreakerResult(afb_api_t api, ModbusRtuT *rtu, int error) {
+  if (!rtu->breaker)
+    return;
+
+  pthread_mutex_lock(&rtu->mutex);
+  if (error != ETIMEDOUT && error != EMBXGTAR) {
+    // link errors say nothing about the slave, retry the probe later
+    if (error == ENOTCONN && rtu->breakerstate == MB_BREAKER_PROBING) {
+      rtu->probeat = ModbusNowMs() + rtu->probe;
+      rtu->breakerstate = MB_BREAKER_OPEN;
+      goto OnExit;
+    }
+    if (error == ENOTCONN)
+      goto OnExit;
+    if (rtu->breakerstate != MB_BREAKER_CLOSED)
+      AFB_API_NOTICE(api, "ModbusBreaker: rtu=%s answers again, breaker closed", rtu->uid);
+    rtu->failures = 0;
+    rtu->breakerstate = MB_BREAKER_CLOSED;
+    goto OnExit;
+  }
+
+  rtu->failures++;
+  if (rtu->breakerstate == MB_BREAKER_CLOSED && rtu->failures < (uint)rtu->breaker)
+    goto OnExit;
+
+  if (rtu->breakerstate == MB_BREAKER_CLOSED) {
+    rtu->trips++;
+    AFB_API_WARNING(api, "ModbusBreaker: rtu=%s silent after %d timeouts, breaker open",
+                    rtu->uid, rtu->failures);
+  }
+  rtu->probeat = ModbusNowMs() + rtu->probe;
+  rtu->breakerstate = MB_BREAKER_OPEN;
+
+OnExit:
+  pthread_mutex_unlock(&rtu->mutex);
+}
+
+// breaker state reported by the info verb
+json_object *ModbusRtuBreakerInfo(ModbusRtuT *rtu) {
+  json_object *breakerJ;
+  uint64_t now = ModbusNowMs();
+
+  pthread_mutex_lock(&rtu->mutex);
+  rp_jsonc_pack(&breakerJ, "{ss si si si}", "state", ModbusBreakerNames[rtu->breakerstate],
+                "failures", rtu->failures, "trips", rtu->trips, "probe_in",
+                rtu->breakerstate == MB_BREAKER_OPEN && rtu->probeat > now
+                    ? (int)(rtu->probeat - now) : 0);
+  pthread_mutex_unlock(&rtu->mutex);
+  return breakerJ;
+}
+
+static const char *ModbusQualityNames[] = {"none", "good", "stale"};
+
+/**
+ * Format a sensor value with its age (ms) and quality
+ *
+ * Buffer, stamp and quality are read under the block cache lock, so they
+ * match even when another pool socket refreshes the block meanwhile.
+ *
+ * @param maxage only accept a good value read at most maxage ms ago,
+ *               0 = any value ever read
+ * @return 0 = OK, -1 when no value qualifies
+ */
+static int ModbusCacheFormat(ModbusSensorT *sensor, uint maxage,
+                             json_object **valueJ, json_object **metaJ) {
+  ModbusBlockT *block = sensor->block;
+  uint64_t now = ModbusNowMs();
+  int err = -1;
+
+  if (!block)
+    return -1;
+
+  pthread_mutex_lock(&block->cache);
+  if (sensor->stamp && (!maxage || (sensor->quality == MB_QUALITY_GOOD &&
+                                    now - sensor->stamp <= maxage)))
+    err = ModbusFormatResponse(sensor, valueJ);
+  if (!err)
+    rp_jsonc_pack(metaJ, "{sI ss}", "age", (int64_t)(now - sensor->stamp),
+                  "quality", ModbusQualityNames[sensor->quality]);
+  pthread_mutex_unlock(&block->cache);
+  return err;
+}
+
+// READ reply: the value, then its age and quality
+static void ModbusReadReply(afb_req_t request,
+                            json_object *valueJ, json_object *metaJ) {
+  afb_data_t repldata[2];
+
+  repldata[0] = afb_data_json_c_hold(valueJ);
+  repldata[1] = afb_data_json_c_hold(metaJ);
+  afb_req_reply(request, 0, 2, repldata);
+}
+
+// reply a read on an open breaker with the last value read, if any
+static void ModbusBreakerReply(afb_req_t request, ModbusSensorT *sensor) {
+  ModbusRtuT *rtu = sensor->rtu;
+  json_object *valueJ = NULL, *metaJ = NULL, *replyJ;
+  afb_data_t repldata;
+
+  if (ModbusCacheFormat(sensor, 0, &valueJ, &metaJ)) {
+    afb_req_reply_string_f(request, AFB_USER_ERRNO(2),
+        "rtu-offline, ModbusSensorRequest: no answer from rtu=%s sensor=%s",
+        rtu->uid, sensor->uid);
+    return;
+  }
+
+  rp_jsonc_pack(&replyJ, "{ss so sO sO}", "error", "rtu-offline", "value", valueJ,
+                "age", json_object_object_get(metaJ, "age"),
+                "quality", json_object_object_get(metaJ, "quality"));
+  json_object_put(metaJ);
+  repldata = afb_data_json_c_hold(replyJ);
+  afb_req_reply(request, AFB_USER_ERRNO(2), 1, &repldata);
 }
 
 /**
@@ -105,161 +543,777 @@ static int ModbusFlush(afb_api_t api, ModbusConnectionT *conn) {
   int rc;
 
   // avoids a syscall when no timeout has occured
-  if (conn->timed_out) {
+  if (atomic_exchange(&conn->timed_out, false)) {
     rc = modbus_flush(conn->context);
 
     if (rc < 0) {
       AFB_API_ERROR(api, "ModbusFlush failed for %s with error %s", conn->uri, modbus_strerror(errno));
+      conn->timed_out = true;
       return 1;
     }
-
-    conn->timed_out = false;
   }
 
   return 0;
 }
 
-static int ModbusReadBits(ModbusSensorT *sensor, json_object **responseJ) {
-  ModbusFunctionCbT *function = sensor->function;
-  ModbusRtuT *rtu = sensor->rtu;
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
-  int err;
+// apply RTU slave id, timeout and debug level to one pool socket, the
+// socket stays owned by the link whatever the result
+static int ModbusLinkSetSlave(afb_api_t api, ModbusRtuT *rtu, modbus_t *ctx) {
 
-  ModbusRtuSemWait(sensor->api, rtu);
-  err = ModbusFlush(sensor->api, rtu->connection);
-  if(err)
-    goto OnErrorExit;
+  if (rtu->slaveid) {
+    if (modbus_set_slave(ctx, rtu->slaveid) == -1) {
+      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set slaveid=%d uid=%s",
+                    rtu->slaveid, rtu->uid);
+      goto OnErrorExit;
+    }
+  }
 
-  // allocate input buffer on 1st read (all buffer are in 16bit for event diff
-  // processing)
-  if (!sensor->buffer) {
-    sensor->buffer = (uint16_t *)calloc(sensor->count, sizeof(uint16_t));
-    if (!sensor->buffer) {
-      AFB_API_ERROR(sensor->api, "ModbusReadBits: out of memory");
+  if (rtu->timeout) {
+    if (modbus_set_response_timeout(ctx, rtu->timeout / 1000, (rtu->timeout % 1000) * 1000) == -1) {
+      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set timeout=%d uid=%s",
+                    rtu->timeout, rtu->uid);
       goto OnErrorExit;
     }
   }
-  uint8_t *data8 = (uint8_t *)sensor->buffer;
 
-  switch (function->type) {
-  case MB_COIL_STATUS:
-    err = modbus_read_bits(ctx, sensor->registry, sensor->count, data8);
-    if (err != sensor->count)
+  if (rtu->debug) {
+    if (modbus_set_debug(ctx, rtu->debug) == -1) {
+      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set debug=%d uid=%s",
+                    rtu->debug, rtu->uid);
       goto OnErrorExit;
-    break;
+    }
+  }
+
+  return 0;
+
+OnErrorExit:
+  return 1;
+}
+
+// monotonic clock in microseconds
+uint64_t ModbusNowUs(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// monotonic clock in milliseconds
+uint64_t ModbusNowMs(void) {
+  return ModbusNowUs() / 1000;
+}
+
+// true when the block was read less than maxage ms ago
+static bool ModbusBlockIsFresh(ModbusBlockT *block, uint maxage) {
+  uint64_t stamp = atomic_load(&block->stamp);
+  return stamp && ModbusNowMs() - stamp < maxage;
+}
+
+// after a write neither the next poll nor a READ max_age may reuse what
+// was read before it
+static void ModbusSensorInvalidate(ModbusSensorT *sensor) {
+  ModbusBlockT *block = sensor->block;
+
+  if (!block) {
+    sensor->stamp = 0;
+    return;
+  }
+  pthread_mutex_lock(&block->cache);
+  sensor->stamp = 0;
+  atomic_store(&block->stamp, 0);
+  pthread_mutex_unlock(&block->cache);
+}
+
+static bool ModbusIsCoil(ModbusFunctionCbT *function) {
+  return function->type == MB_COIL_STATUS || function->type == MB_COIL_INPUT;
+}
+
+// read 'count' registers/coils at 'registry' into the block buffer
+static int ModbusChunkRead(modbus_t *ctx, ModbusBlockT *block, uint registry,
+                           uint count) {
+  uint offset = registry - block->registry;
+
+  switch (block->function->type) {
+  case MB_COIL_STATUS:
+    return modbus_read_bits(ctx, registry, count,
+                            (uint8_t *)block->buffer + offset);
 
   case MB_COIL_INPUT:
-    err = modbus_read_input_bits(ctx, sensor->registry, sensor->count, data8);
-    if (err != sensor->count)
-      goto OnErrorExit;
-    break;
+    return modbus_read_input_bits(ctx, registry, count,
+                                  (uint8_t *)block->buffer + offset);
+
+  case MB_REGISTER_INPUT:
+    return modbus_read_input_registers(ctx, registry, count,
+                                       &block->buffer[offset]);
+
+  case MB_REGISTER_HOLDING:
+    return modbus_read_registers(ctx, registry, count,
+                                 &block->buffer[offset]);
 
   default:
-    err = 0;
+    return 0;
+  }
+}
+
+// shrink [*registry, *end[ to the registers used by member sensors,
+// return false when no sensor uses any of them
+static bool ModbusChunkTrim(ModbusBlockT *block, uint *registry, uint *end) {
+  uint low = *end, high = *registry, start, stop;
+
+  for (int idx = 0; block->sensors[idx]; idx++) {
+    start = block->sensors[idx]->registry;
+    stop = start + ModbusSensorSpan(block->sensors[idx]);
+    if (start < *registry)
+      start = *registry;
+    if (stop > *end)
+      stop = *end;
+    if (start >= stop)
+      continue;
+    if (start < low)
+      low = start;
+    if (stop > high)
+      high = stop;
+  }
+  if (low >= high)
+    return false;
+
+  *registry = low;
+  *end = high;
+  return true;
+}
+
+// move 'cut' down so that it does not fall in the middle of a sensor value
+// (multi-register formats), return 0 when no cut remains above 'low'
+static uint ModbusChunkAlign(ModbusBlockT *block, uint low, uint cut) {
+  ModbusSensorT *member;
+  uint start, element;
+  bool moved = true;
+
+  while (moved && cut > low) {
+    moved = false;
+    for (int idx = 0; block->sensors[idx]; idx++) {
+      member = block->sensors[idx];
+      start = member->registry;
+      if (start >= cut || start + ModbusSensorSpan(member) <= cut)
+        continue;
+      element = ModbusIsCoil(block->function) ? 1 : member->format->nbreg;
+      if ((cut - start) % element) {
+        cut = start + ((cut - start) / element) * element;
+        moved = true;
+      }
+    }
+  }
+  return cut > low ? cut : 0;
+}
+
+// address where a chunk should be bisected, 0 when it cannot be split.
+// The sensor boundary closest to the middle wins, a chunk holding a single
+// sensor is cut between two of its values.
+static uint ModbusChunkCut(ModbusBlockT *block, ModbusRangeT *chunk) {
+  uint middle = chunk->registry + chunk->count / 2;
+  uint cut = 0, start;
+
+  for (int idx = 0; block->sensors[idx]; idx++) {
+    start = block->sensors[idx]->registry;
+    if (start <= chunk->registry || start >= chunk->registry + chunk->count)
+      continue;
+    if (!cut || abs((int)start - (int)middle) < abs((int)cut - (int)middle))
+      cut = start;
+  }
+  if (!cut)
+    cut = ModbusChunkAlign(block, chunk->registry, middle);
+  return cut;
+}
+
+// replace chunk 'idx' by its two halves, dropping halves no sensor uses
+static int ModbusChunkSplit(ModbusBlockT *block, uint idx, uint cut) {
+  ModbusRangeT halves[2], *chunks;
+  uint start = block->chunks[idx].registry;
+  uint end = start + block->chunks[idx].count;
+  uint bounds[2][2] = {{start, cut}, {cut, end}};
+  uint count = 0;
+
+  for (int half = 0; half < 2; half++) {
+    if (!ModbusChunkTrim(block, &bounds[half][0], &bounds[half][1]))
+      continue;
+    halves[count].function = block->function;
+    halves[count].registry = bounds[half][0];
+    halves[count].count = bounds[half][1] - bounds[half][0];
+    count++;
+  }
+
+  chunks = (ModbusRangeT *)calloc(block->nchunks - 1 + count, sizeof(ModbusRangeT));
+  if (!chunks)
+    return -1;
+  memcpy(chunks, block->chunks, idx * sizeof(ModbusRangeT));
+  memcpy(&chunks[idx], halves, count * sizeof(ModbusRangeT));
+  memcpy(&chunks[idx + count], &block->chunks[idx + 1],
+         (block->nchunks - idx - 1) * sizeof(ModbusRangeT));
+
+  free(block->chunks);
+  block->chunks = chunks;
+  block->nchunks += count - 1;
+  return 0;
+}
+
+// copy block data into fully refreshed member sensors ('got' registers
+// received per member), return 0 when 'sensor' was refreshed
+static int ModbusBlockSlice(ModbusBlockT *block, uint *got, ModbusSensorT *sensor) {
+  ModbusSensorT *member;
+  uint64_t now = ModbusNowMs();
+  uint offset;
+  int result = -1;
+
+  // every member is published at once, readers never see half a block
+  pthread_mutex_lock(&block->cache);
+  for (int idx = 0; block->sensors[idx]; idx++) {
+    member = block->sensors[idx];
+    if (got[idx] != ModbusSensorSpan(member)) {
+      // value kept, but flagged as outdated
+      if (member->quality == MB_QUALITY_GOOD)
+        member->quality = MB_QUALITY_STALE;
+      continue;
+    }
+    offset = member->registry - block->registry;
+    memcpy(member->previous, member->buffer, ModbusSensorBytes(member));
+    if (ModbusIsCoil(block->function))
+      memcpy(member->buffer, (uint8_t *)block->buffer + offset, member->count);
+    else
+      memcpy(member->buffer, &block->buffer[offset], ModbusSensorBytes(member));
+    member->prevstamp = member->stamp;
+    member->stamp = now;
+    member->quality = MB_QUALITY_GOOD;
+    if (member == sensor)
+      result = 0;
+  }
+  pthread_mutex_unlock(&block->cache);
+  return result;
+}
+
+// block read failed before any transaction, cached values become stale
+static void ModbusBlockStale(ModbusBlockT *block) {
+  uint *got = (uint *)alloca(block->nsensors * sizeof(uint));
+
+  memset(got, 0, block->nsensors * sizeof(uint));
+  ModbusBlockSlice(block, got, NULL);
+}
+
+/**
+ * Reads a block and copies the result into the buffer of every sensor
+ * sharing this block.
+ *
+ * Each chunk of the block split map costs one modbus transaction. Chunks
+ * larger than the protocol limits (125 registers, 2000 coils) are cut into
+ * legal transactions before being sent, so one sensor may span several of
+ * them. When the device rejects a chunk with an illegal address/value
+ * exception, the chunk is bisected and both halves are retried. The new
+ * split map is kept for the process lifetime, and "illegal value" answers
+ * teach the RTU largest accepted read, so other blocks get split before
+ * being sent. Sensors from a chunk which cannot be split anymore fail
+ * alone, without failing the rest of the block.
+ *
+ * Must be called on the connection I/O thread.
+ *
+ * @return 0 when 'sensor' was refreshed, -1 otherwise with errno set
+ */
+static int ModbusBlockRead(afb_api_t api, ModbusRtuT *rtu, ModbusConnectionT *link,
+                           ModbusBlockT *block, ModbusSensorT *sensor) {
+  modbus_t *ctx = (modbus_t *)link->context;
+  uint *limit = ModbusIsCoil(block->function) ? &rtu->maxbits : &rtu->maxregs;
+  uint *got = (uint *)alloca(block->nsensors * sizeof(uint));
+  uint registry, count, cut, start, stop, maxspan;
+  uint64_t sentat;
+  int err, status = 0, error = 0, result;
+
+  memset(got, 0, block->nsensors * sizeof(uint));
+
+  for (uint idx = 0; idx < block->nchunks;) {
+    registry = block->chunks[idx].registry;
+    count = block->chunks[idx].count;
+
+    // protocol or learned device limit, send the largest legal prefix
+    maxspan = ModbusIsCoil(block->function) ? MODBUS_MAX_READ_BITS
+                                            : MODBUS_MAX_READ_REGISTERS;
+    if (*limit && *limit < maxspan)
+      maxspan = *limit;
+    if (count > maxspan) {
+      cut = ModbusChunkAlign(block, registry, registry + maxspan);
+      if (cut) {
+        if (ModbusChunkSplit(block, idx, cut))
+          goto OnMemoryError;
+        continue;
+      }
+    }
+
+    sentat = ModbusNowUs();
+    err = ModbusChunkRead(ctx, block, registry, count);
+    if (err == count || (err == -1 && (errno == EMBXILADD || errno == EMBXILVAL)))
+      ModbusLatencyRecord(rtu, block->function->type, ModbusNowUs() - sentat);
+    if (err == count) {
+      // account registers received by every member sensor
+      for (int jdx = 0; block->sensors[jdx]; jdx++) {
+        start = block->sensors[jdx]->registry;
+        stop = start + ModbusSensorSpan(block->sensors[jdx]);
+        if (start < registry)
+          start = registry;
+        if (stop > registry + count)
+          stop = registry + count;
+        if (start < stop)
+          got[jdx] += stop - start;
+      }
+      idx++;
+      continue;
+    }
+
+    status = err;
+    error = errno;
+    if (err != -1 || (errno != EMBXILADD && errno != EMBXILVAL))
+      break; // transport error, stop talking to the device
+
+    cut = ModbusChunkCut(block, &block->chunks[idx]);
+    if (cut) {
+      if (error == EMBXILVAL && (!*limit || count - 1 < *limit))
+        *limit = count - 1;
+      AFB_API_NOTICE(api,
+                     "ModbusBlockRead: rtu=%s split register=%d count=%d at=%d error=%s",
+                     rtu->uid, registry, count, cut, modbus_strerror(error));
+      if (ModbusChunkSplit(block, idx, cut))
+        goto OnMemoryError;
+      continue;
+    }
+
+    // cannot split anymore, only sensors of this chunk fail
+    idx++;
+  }
+
+  result = ModbusBlockSlice(block, got, sensor);
+  if (status == 0)
+    atomic_store(&block->stamp, ModbusNowMs());
+
+  if (result)
+    errno = error;
+  return result;
+
+OnMemoryError:
+  AFB_API_ERROR(api, "ModbusBlockRead: out of memory");
+  errno = ENOMEM;
+  return -1;
+}
+
+// I/O thread side of a sensor read, refreshes the whole sensor block
+int ModbusSensorReadRun(ModbusXferT *xfer) {
+  ModbusSensorT *sensor = (ModbusSensorT *)xfer->context;
+  ModbusRtuT *rtu = sensor->rtu;
+  ModbusConnectionT *link = xfer->link;
+  int err = 0;
+
+  if (!link->context) {
+    ModbusBlockStale(sensor->block);
+    errno = ENOTCONN;
     goto OnErrorExit;
   }
 
-  // if responseJ is provided build JSON response
+  if (ModbusLinkSetSlave(sensor->api, rtu, (modbus_t *)link->context))
+    goto OnErrorExit;
+  ModbusLatencyApply(rtu, (modbus_t *)link->context, sensor->block->function->type);
+  err = ModbusFlush(sensor->api, link);
+  if(err)
+    goto OnErrorExit;
+
+  // one transaction refreshes every sensor sharing the block
+  pthread_mutex_lock(&sensor->block->mutex);
+  err = ModbusBlockRead(sensor->api, rtu, link, sensor->block, sensor);
+  pthread_mutex_unlock(&sensor->block->mutex);
+  if (err)
+    goto OnErrorExit;
+
+  ModbusLinkOk(link);
+  ModbusBreakerResult(sensor->api, rtu, 0);
+  return 0;
+
+OnErrorExit:
+  err = errno;
+  AFB_API_ERROR(sensor->api,
+                "ModbusSensorRead: fail to read rtu=%s sensor=%s type=%s error=%s",
+                rtu->uid, sensor->uid, sensor->function->uid, modbus_strerror(err));
+  ModbusLinkError(sensor->api, xfer->link, err);
+  ModbusBreakerResult(sensor->api, rtu, err);
+  errno = err;
+  return 1;
+}
+
+/**
+ * Reads a sensor (and the rest of its block) on the connection I/O thread
+ *
+ * Blocks the caller until the transaction completed: readCB entry, never
+ * used from a verb (see ModbusRequestSubmit).
+ *
+ * @param class bus access class of the caller
+ * @param deadline monotonic time (ms) the read should complete by, orders
+ *                 transactions of the same class
+ */
+static int ModbusSensorRead(ModbusSensorT *sensor, json_object **responseJ,
+                            ModbusClassE class, uint64_t deadline) {
+  ModbusXferT xfer = {.class = class, .deadline = deadline,
+                      .runCB = ModbusSensorReadRun, .context = sensor};
+  int err;
+
+  if (!ModbusBreakerAllows(sensor->rtu, false)) {
+    errno = EMBXGTAR;
+    goto OnErrorExit;
+  }
+
+  err = ModbusXferRun(sensor->rtu->connection, &xfer);
+  if (err)
+    goto OnErrorExit;
+
+  // if responseJ is provided build JSON response, other sockets of a pool
+  // may refresh the block meanwhile
   if (responseJ) {
+    pthread_mutex_lock(&sensor->block->cache);
     err = ModbusFormatResponse(sensor, responseJ);
+    pthread_mutex_unlock(&sensor->block->cache);
     if (err)
       goto OnErrorExit;
   }
-
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
   return 0;
 
 OnErrorExit:
-  AFB_API_ERROR(sensor->api,
-                "ModbusReadBit: fail to read rtu=%s sensor=%s error=%s",
-                rtu->uid, sensor->uid, modbus_strerror(errno));
-  if (err == -1)
-    ModbusReconnect(sensor);
-  if (errno == ETIMEDOUT)
-    rtu->connection->timed_out = true;
-
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
   return 1;
 }
 
-static int ModbusReadRegisters(ModbusSensorT *sensor, json_object **responseJ) {
-  ModbusFunctionCbT *function = sensor->function;
-  ModbusFormatCbT *format = sensor->format;
-  ModbusRtuT *rtu = sensor->rtu;
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
-  int err, regcount;
+// one asynchronous block read on the native TCP engine
+typedef struct {
+  ModbusXferT *xfer;
+  ModbusSensorT *sensor;
+  atomic_uint pending;  // chunks waiting for their response
+  atomic_int error;     // first transport error
+  atomic_bool split;    // device exception, needs the split path
+} ModbusNativeReadT;
+
+typedef struct {
+  ModbusNativeReadT *read;
+  uint registry;
+  uint count;
+  uint64_t sentat;  // monotonic time (us) handed to the engine
+} ModbusNativeChunkT;
+
+// every chunk answered, complete the transaction like the I/O thread does
+static void ModbusNativeDone(ModbusNativeReadT *read) {
+  ModbusXferT *xfer = read->xfer;
+  ModbusSensorT *sensor = read->sensor;
+  ModbusBlockT *block = sensor->block;
+  uint *got;
+  int error = atomic_load(&read->error);
+
+  if (error) {
+    AFB_API_ERROR(sensor->api,
+                  "ModbusNativeDone: fail to read rtu=%s sensor=%s type=%s error=%s",
+                  sensor->rtu->uid, sensor->uid, sensor->function->uid, modbus_strerror(error));
+    xfer->status = 1;
+    xfer->error = error;
+    ModbusBlockStale(block);
+    ModbusLinkError(sensor->api, xfer->link, error);
+    ModbusBreakerResult(sensor->api, sensor->rtu, error);
+  } else if (atomic_load(&read->split)) {
+    // libmodbus path learns the device limits and splits the block
+    if (!ModbusXferSubmit(sensor->rtu->connection, xfer))
+      goto OnExit;
+    xfer->status = 1;
+    xfer->error = errno;
+  } else {
+    got = (uint *)alloca(block->nsensors * sizeof(uint));
+    for (uint idx = 0; idx < block->nsensors; idx++)
+      got[idx] = ModbusSensorSpan(block->sensors[idx]);
+    pthread_mutex_lock(&block->mutex);
+    ModbusBlockSlice(block, got, sensor);
+    atomic_store(&block->stamp, ModbusNowMs());
+    pthread_mutex_unlock(&block->mutex);
+    ModbusLinkOk(xfer->link);
+    ModbusBreakerResult(sensor->api, sensor->rtu, 0);
+    xfer->status = 0;
+    xfer->error = 0;
+  }
+  xfer->doneCB(xfer);
 
-  ModbusRtuSemWait(sensor->api, rtu);
-  err = ModbusFlush(sensor->api, rtu->connection);
-  if(err)
-    goto OnErrorExit;
+OnExit:
+  free(read);
+}
+
+static void ModbusNativeChunkDone(void *closure, int error, const uint8_t *pdu, uint len) {
+  ModbusNativeChunkT *chunk = (ModbusNativeChunkT *)closure;
+  ModbusNativeReadT *read = chunk->read;
+  ModbusBlockT *block = read->sensor->block;
+  uint offset = chunk->registry - block->registry;
+  uint bytes = ModbusIsCoil(block->function) ? (chunk->count + 7) / 8 : chunk->count * 2;
+  int expected = 0;
+
+  // the device answered, same samples as the I/O thread takes
+  if (!error || error == EMBXILADD || error == EMBXILVAL)
+    ModbusLatencyRecord(read->sensor->rtu, block->function->type,
+                        ModbusNowUs() - chunk->sentat);
+
+  if (error == EMBXILADD || error == EMBXILVAL) {
+    atomic_store(&read->split, true);
+  } else if (error) {
+    atomic_compare_exchange_strong(&read->error, &expected, error);
+  } else if (len < 2 + bytes || pdu[1] != bytes) {
+    atomic_compare_exchange_strong(&read->error, &expected, EMBBADDATA);
+  } else {
+    // the I/O thread may be reading the same block on another socket
+    pthread_mutex_lock(&block->mutex);
+    if (ModbusIsCoil(block->function)) {
+      // one byte per coil, as libmodbus does
+      for (uint idx = 0; idx < chunk->count; idx++)
+        ((uint8_t *)block->buffer)[offset + idx] = (pdu[2 + idx / 8] >> (idx % 8)) & 1;
+    } else {
+      for (uint idx = 0; idx < chunk->count; idx++)
+        block->buffer[offset + idx] = (pdu[2 + 2 * idx] << 8) | pdu[3 + 2 * idx];
+    }
+    pthread_mutex_unlock(&block->mutex);
+  }
 
-  regcount =
-      sensor->count * format->nbreg; // number of register to read on device
+  // chunk contexts are freed with the read context
+  if (atomic_fetch_sub(&read->pending, 1) == 1)
+    ModbusNativeDone(read);
+}
 
-  // allocate input buffer on 1st read
-  if (!sensor->buffer) {
-    sensor->buffer = (uint16_t *)calloc(regcount, sizeof(uint16_t));
-    if (!sensor->buffer) {
-      AFB_API_ERROR(sensor->api, "ModbusReadRegisters: out of memory");
-      goto OnErrorExit;
+/**
+ * Read a sensor block through the native TCP engine
+ *
+ * Every chunk of the block split map is sent at once and pipelined on the
+ * gateway socket. Device exceptions hand the read over to the I/O thread,
+ * which splits the block and learns the device limits.
+ *
+ * @return 0 when sent, -1 when the I/O thread must be used
+ */
+static int ModbusNativeRead(ModbusSensorT *sensor, ModbusXferT *xfer) {
+  ModbusRtuT *rtu = sensor->rtu;
+  ModbusTcpT *tcp = xfer->link->tcp;
+  ModbusBlockT *block = sensor->block;
+  uint limit = ModbusIsCoil(block->function) ? rtu->maxbits : rtu->maxregs;
+  uint maxspan = ModbusIsCoil(block->function) ? MODBUS_MAX_READ_BITS
+                                               : MODBUS_MAX_READ_REGISTERS;
+  ModbusNativeReadT *read;
+  ModbusNativeChunkT *chunks;
+  uint8_t pdu[5];
+  uint sent, nchunks;
+
+  if (limit && limit < maxspan)
+    maxspan = limit;
+
+  // another pool socket may be splitting the block
+  pthread_mutex_lock(&block->mutex);
+  nchunks = block->nchunks;
+  for (uint idx = 0; idx < nchunks; idx++) {
+    if (block->chunks[idx].count > maxspan) {
+      pthread_mutex_unlock(&block->mutex);
+      return -1;
     }
   }
 
-  switch (function->type) {
-  case MB_REGISTER_INPUT:
-    err = modbus_read_input_registers(ctx, sensor->registry, regcount,
-                                      (uint16_t *)sensor->buffer);
-    if (err != regcount)
-      goto OnErrorExit;
-    break;
+  // chunk contexts follow the read context in the same allocation
+  read = (ModbusNativeReadT *)calloc(1, sizeof(ModbusNativeReadT) +
+                                            nchunks * sizeof(ModbusNativeChunkT));
+  if (!read) {
+    pthread_mutex_unlock(&block->mutex);
+    return -1;
+  }
+  chunks = (ModbusNativeChunkT *)(read + 1);
+  read->xfer = xfer;
+  read->sensor = sensor;
+  atomic_init(&read->pending, nchunks);
+  atomic_init(&read->error, 0);
+  atomic_init(&read->split, false);
+
+  // completions take the block mutex, and may run before the send returns
+  for (uint idx = 0; idx < nchunks; idx++) {
+    chunks[idx].read = read;
+    chunks[idx].registry = block->chunks[idx].registry;
+    chunks[idx].count = block->chunks[idx].count;
+  }
+  pthread_mutex_unlock(&block->mutex);
 
+  switch (block->function->type) {
+  case MB_COIL_STATUS:
+    pdu[0] = 0x01;
+    break;
+  case MB_COIL_INPUT:
+    pdu[0] = 0x02;
+    break;
   case MB_REGISTER_HOLDING:
-    err = modbus_read_registers(ctx, sensor->registry, regcount,
-                                (uint16_t *)sensor->buffer);
-    if (err != regcount)
-      goto OnErrorExit;
+    pdu[0] = 0x03;
     break;
-
   default:
-    err = 0;
-    goto OnErrorExit;
+    pdu[0] = 0x04;
+    break;
   }
 
-  // if responseJ is provided build JSON response
-  if (responseJ) {
-    err = ModbusFormatResponse(sensor, responseJ);
-    if (err)
-      goto OnErrorExit;
+  for (sent = 0; sent < nchunks; sent++) {
+    pdu[1] = chunks[sent].registry >> 8;
+    pdu[2] = chunks[sent].registry & 0xFF;
+    pdu[3] = chunks[sent].count >> 8;
+    pdu[4] = chunks[sent].count & 0xFF;
+    chunks[sent].sentat = ModbusNowUs();
+    if (ModbusTcpSend(tcp, rtu->slaveid ? rtu->slaveid : 0xFF, pdu,
+                      sizeof(pdu), ModbusRtuTimeout(rtu, block->function->type),
+                      ModbusNativeChunkDone, &chunks[sent]))
+      break;
   }
 
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+  // chunks not sent count as failed, the last answer completes the read
+  if (sent < nchunks) {
+    int expected = 0;
+    atomic_compare_exchange_strong(&read->error, &expected, errno);
+    if (!sent) {
+      free(read);
+      return -1;
+    }
+    if (atomic_fetch_sub(&read->pending, nchunks - sent) == nchunks - sent)
+      ModbusNativeDone(read);
+  }
   return 0;
+}
 
-OnErrorExit:
-  AFB_API_ERROR(sensor->api,
-                "ModbusReadRegisters: fail to read rtu=%s sensor=%s error=%s",
-                rtu->uid, sensor->uid, modbus_strerror(errno));
-  if (err == -1)
-    ModbusReconnect(sensor);
-  if (errno == ETIMEDOUT)
-    rtu->connection->timed_out = true;
+// flight landed, every attached read gets the outcome for its own sensor
+static void ModbusFlightDone(ModbusXferT *flight) {
+  ModbusSensorT *sensor = (ModbusSensorT *)flight->context;
+  ModbusBlockT *block = sensor->block;
+  ModbusXferT *waiter, *next, *waiters;
+  ModbusSensorT *member;
+
+  // the flight may be relaunched as soon as the lock is released, every
+  // outcome is settled before
+  pthread_mutex_lock(&block->cache);
+  waiters = block->waiters;
+  for (waiter = waiters; waiter; waiter = waiter->next) {
+    member = (ModbusSensorT *)waiter->context;
+    waiter->link = flight->link;
+    // a split block may refresh some members and fail others
+    if (member == sensor ? !flight->status
+                         : member->stamp >= block->launched &&
+                               member->quality == MB_QUALITY_GOOD) {
+      waiter->status = 0;
+      waiter->error = 0;
+    } else {
+      waiter->status = 1;
+      waiter->error = flight->error ? flight->error : EIO;
+    }
+  }
+  block->waiters = NULL;
+  block->waitail = &block->waiters;
+  block->flying = false;
+  pthread_mutex_unlock(&block->cache);
+
+  for (waiter = waiters; waiter; waiter = next) {
+    next = waiter->next;
+    waiter->doneCB(waiter);
+  }
+}
 
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
-  return 1;
+/**
+ * Asynchronous block read, coalesced with the reads already in flight
+ *
+ * The first read of a block launches a flight on the least loaded pool
+ * socket, through the native engine when available else the I/O thread.
+ * Reads of any sensor of the block arriving before it lands (client READs
+ * and subscription polls) attach to it and complete with its result, so
+ * N concurrent readers cost one bus transaction. Attached reads share the
+ * class, deadline and expiry of the first one.
+ *
+ * @return 0 when queued or attached, -1 with errno set otherwise
+ */
+int ModbusSensorReadSubmit(ModbusSensorT *sensor, ModbusXferT *xfer) {
+  ModbusBlockT *block = sensor->block;
+  ModbusXferT *flight = &block->flight;
+  int err;
+
+  pthread_mutex_lock(&block->cache);
+  if (!block->waitail)
+    block->waitail = &block->waiters;
+  xfer->next = NULL;
+  *block->waitail = xfer;
+  block->waitail = &xfer->next;
+  if (block->flying) {
+    pthread_mutex_unlock(&block->cache);
+    return 0;
+  }
+  block->flying = true;
+  block->launched = ModbusNowMs();
+  pthread_mutex_unlock(&block->cache);
+
+  memset(flight, 0, sizeof(ModbusXferT));
+  flight->class = xfer->class;
+  flight->deadline = xfer->deadline;
+  flight->expire = xfer->expire;
+  flight->runCB = ModbusSensorReadRun;
+  flight->doneCB = ModbusFlightDone;
+  flight->context = sensor;
+  flight->link = ModbusConnectionPick(sensor->rtu->connection);
+  if (flight->link->tcp && ModbusLinkUsable(flight->link) && !ModbusNativeRead(sensor, flight))
+    return 0;
+  err = ModbusXferSubmit(sensor->rtu->connection, flight);
+  if (!err)
+    return 0;
+
+  // nothing queued, readers attached meanwhile fail with us
+  err = errno;
+  pthread_mutex_lock(&block->cache);
+  xfer = block->waiters;
+  block->waiters = NULL;
+  block->waitail = &block->waiters;
+  block->flying = false;
+  pthread_mutex_unlock(&block->cache);
+
+  for (ModbusXferT *next, *waiter = xfer->next; waiter; waiter = next) {
+    next = waiter->next;
+    waiter->status = 1;
+    waiter->error = err;
+    waiter->doneCB(waiter);
+  }
+  errno = err;
+  return -1;
 }
 
-static int ModbusWriteBits(ModbusSensorT *sensor, json_object *queryJ) {
+static int ModbusReadBits(ModbusSensorT *sensor, json_object **responseJ) {
+  return ModbusSensorRead(sensor, responseJ, MB_CLASS_READ, ModbusNowMs());
+}
+
+static int ModbusReadRegisters(ModbusSensorT *sensor, json_object **responseJ) {
+  return ModbusSensorRead(sensor, responseJ, MB_CLASS_READ, ModbusNowMs());
+}
+
+// writes are executed on the connection I/O thread, the caller waits:
+// writeCB entry, never used from a verb (see ModbusRequestSubmit)
+static int ModbusSensorWrite(ModbusSensorT *sensor, json_object *queryJ,
+                             int (*runCB)(ModbusXferT *xfer)) {
+  ModbusXferT xfer = {.class = MB_CLASS_WRITE, .deadline = ModbusNowMs(),
+                      .runCB = runCB, .context = sensor, .data = queryJ};
+
+  return ModbusXferRun(sensor->rtu->connection, &xfer) ? 1 : 0;
+}
+
+static int ModbusWriteBitsRun(ModbusXferT *xfer) {
+  ModbusSensorT *sensor = (ModbusSensorT *)xfer->context;
+  json_object *queryJ = (json_object *)xfer->data;
   ModbusFormatCbT *format = sensor->format;
   ModbusRtuT *rtu = sensor->rtu;
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
+  modbus_t *ctx = (modbus_t *)xfer->link->context;
   json_object *elemJ;
-  int err, idx;
+  uint64_t start;
+  int err = 0, idx;
+
+  if (!ctx) {
+    errno = ENOTCONN;
+    goto OnErrorExit;
+  }
 
-  ModbusRtuSemWait(sensor->api, rtu);
-  err = ModbusFlush(sensor->api, rtu->connection);
+  if (ModbusLinkSetSlave(sensor->api, rtu, ctx))
+    goto OnErrorExit;
+  ModbusLatencyApply(rtu, ctx, MB_LATENCY_WRITE);
+  err = ModbusFlush(sensor->api, xfer->link);
   if(err)
     goto OnErrorExit;
+  start = ModbusNowUs();
 
   uint8_t *data8 =
       (uint8_t *)alloca(sizeof(uint8_t) * sensor->count);
@@ -285,7 +1339,11 @@ static int ModbusWriteBits(ModbusSensorT *sensor, json_object *queryJ) {
       goto OnErrorExit;
   }
 
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+  ModbusSensorInvalidate(sensor);
+
+  ModbusLatencyRecord(rtu, MB_LATENCY_WRITE, ModbusNowUs() - start);
+  ModbusLinkOk(xfer->link);
+  ModbusBreakerResult(sensor->api, rtu, 0);
   return 0;
 
 OnErrorExit:
@@ -294,20 +1352,21 @@ OnErrorExit:
       "ModbusWriteBits: fail to write rtu=%s sensor=%s error=%s data=%s",
       rtu->uid, sensor->uid, modbus_strerror(errno),
       json_object_get_string(queryJ));
-  if (err == -1)
-    ModbusReconnect(sensor);
-  if (errno == ETIMEDOUT)
-    rtu->connection->timed_out = true;
-
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+  err = errno;
+  ModbusLinkError(sensor->api, xfer->link, err);
+  ModbusBreakerResult(sensor->api, rtu, err);
+  errno = err;
   return 1;
 }
 
-static int ModbusWriteRegisters(ModbusSensorT *sensor, json_object *queryJ) {
+static int ModbusWriteRegistersRun(ModbusXferT *xfer) {
+  ModbusSensorT *sensor = (ModbusSensorT *)xfer->context;
+  json_object *queryJ = (json_object *)xfer->data;
   ModbusFormatCbT *format = sensor->format;
   ModbusRtuT *rtu = sensor->rtu;
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
+  modbus_t *ctx = (modbus_t *)xfer->link->context;
   json_object *elemJ;
+  uint64_t start;
   int err = 0;
   int idx = 0;
   ModbusSourceT source;
@@ -320,10 +1379,18 @@ static int ModbusWriteRegisters(ModbusSensorT *sensor, json_object *queryJ) {
   source.api = sensor->api;
   source.context = sensor->context;
 
-  ModbusRtuSemWait(sensor->api, rtu);
-  err = ModbusFlush(sensor->api, rtu->connection);
+  if (!ctx) {
+    errno = ENOTCONN;
+    goto OnErrorExit;
+  }
+
+  if (ModbusLinkSetSlave(sensor->api, rtu, ctx))
+    goto OnErrorExit;
+  ModbusLatencyApply(rtu, ctx, MB_LATENCY_WRITE);
+  err = ModbusFlush(sensor->api, xfer->link);
   if(err)
     goto OnErrorExit;
+  start = ModbusNowUs();
 
   if (!format->encodeCB) {
     AFB_API_NOTICE(sensor->api, "ModbusFormatResponse: No encodeCB uid=%s",
@@ -361,7 +1428,12 @@ static int ModbusWriteRegisters(ModbusSensorT *sensor, json_object *queryJ) {
     if (err != format->nbreg)
       goto OnErrorExit;
   }
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+
+  ModbusSensorInvalidate(sensor);
+
+  ModbusLatencyRecord(rtu, MB_LATENCY_WRITE, ModbusNowUs() - start);
+  ModbusLinkOk(xfer->link);
+  ModbusBreakerResult(sensor->api, rtu, 0);
   return 0;
 
 OnErrorExit:
@@ -370,12 +1442,80 @@ OnErrorExit:
       "ModbusWriteBits: fail to write rtu=%s sensor=%s error=%s data=%s",
       rtu->uid, sensor->uid, modbus_strerror(errno),
       json_object_get_string(queryJ));
-  if (err == -1)
-    ModbusReconnect(sensor);
-  if (errno == ETIMEDOUT)
-    rtu->connection->timed_out = true;
+  err = errno;
+  ModbusLinkError(sensor->api, xfer->link, err);
+  ModbusBreakerResult(sensor->api, rtu, err);
+  errno = err;
+  return 1;
+}
+
+static int ModbusWriteBits(ModbusSensorT *sensor, json_object *queryJ) {
+  return ModbusSensorWrite(sensor, queryJ, ModbusWriteBitsRun);
+}
+
+static int ModbusWriteRegisters(ModbusSensorT *sensor, json_object *queryJ) {
+  return ModbusSensorWrite(sensor, queryJ, ModbusWriteRegistersRun);
+}
 
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+/**
+ * I/O thread side of a raw write forwarded by the Modbus/TCP server
+ *
+ * Same bus handling as sensor writes: slave selection, learned timeout,
+ * link and breaker accounting. Sensors overlapping the written range are
+ * invalidated so the next poll reads them again.
+ *
+ * @return 0 = OK, 1 with errno set otherwise
+ */
+int ModbusRawWriteRun(ModbusXferT *xfer) {
+  ModbusRtuT *rtu = (ModbusRtuT *)xfer->context;
+  ModbusRawWriteT *raw = (ModbusRawWriteT *)xfer->data;
+  modbus_t *ctx = (modbus_t *)xfer->link->context;
+  ModbusSensorT *sensor;
+  uint64_t start;
+  int err;
+
+  if (!ctx) {
+    errno = ENOTCONN;
+    goto OnErrorExit;
+  }
+
+  if (ModbusLinkSetSlave(raw->api, rtu, ctx))
+    goto OnErrorExit;
+  ModbusLatencyApply(rtu, ctx, MB_LATENCY_WRITE);
+  if (ModbusFlush(raw->api, xfer->link))
+    goto OnErrorExit;
+  start = ModbusNowUs();
+
+  if (raw->type == MB_COIL_STATUS) {
+    err = raw->single ? modbus_write_bit(ctx, raw->registry, raw->bits[0])
+                      : modbus_write_bits(ctx, raw->registry, raw->count, raw->bits);
+  } else {
+    err = raw->single ? modbus_write_register(ctx, raw->registry, raw->registers[0])
+                      : modbus_write_registers(ctx, raw->registry, raw->count, raw->registers);
+  }
+  if (err != (int)raw->count)
+    goto OnErrorExit;
+
+  for (sensor = rtu->sensors; sensor->uid; sensor++) {
+    if (sensor->function->type == raw->type &&
+        sensor->registry < raw->registry + raw->count &&
+        raw->registry < sensor->registry + ModbusSensorSpan(sensor)) {
+      ModbusSensorInvalidate(sensor);
+    }
+  }
+
+  ModbusLatencyRecord(rtu, MB_LATENCY_WRITE, ModbusNowUs() - start);
+  ModbusLinkOk(xfer->link);
+  ModbusBreakerResult(raw->api, rtu, 0);
+  return 0;
+
+OnErrorExit:
+  err = errno;
+  AFB_API_ERROR(raw->api, "ModbusRawWrite: fail to write rtu=%s register=%d count=%d error=%s",
+                rtu->uid, raw->registry, raw->count, modbus_strerror(err));
+  ModbusLinkError(raw->api, xfer->link, err);
+  ModbusBreakerResult(raw->api, rtu, err);
+  errno = err;
   return 1;
 }
 
@@ -410,123 +1550,671 @@ ModbusFunctionCbT *mbFunctionFind(afb_api_t api, const char *uid) {
   int idx;
   assert(uid);
 
-  for (idx = 0; ModbusFunctionsCB[idx].uid; idx++) {
-    if (!strcasecmp(ModbusFunctionsCB[idx].uid, uid))
+  for (idx = 0; ModbusFunctionsCB[idx].uid; idx++) {
+    if (!strcasecmp(ModbusFunctionsCB[idx].uid, uid))
+      break;
+  }
+
+  return (&ModbusFunctionsCB[idx]);
+}
+
+// decoded numeric value of one sensor element, NAN when not a number
+static double ModbusSensorValue(ModbusSensorT *sensor, ModbusSourceT *source, uint index) {
+  json_object *valueJ = NULL;
+  double value = NAN;
+
+  if (sensor->format->decodeCB(source, sensor->format, sensor->buffer, index, &valueJ))
+    return NAN;
+
+  switch (json_object_get_type(valueJ)) {
+  case json_type_int:
+  case json_type_double:
+  case json_type_boolean:
+    value = json_object_get_double(valueJ);
+    break;
+  default:
+    break;
+  }
+  json_object_put(valueJ);
+  return value;
+}
+
+// raw compare of one sensor element, coils are stored as bytes
+static bool ModbusElementDiffers(ModbusSensorT *sensor, uint16_t *a, uint16_t *b, uint idx) {
+  uint nbreg = sensor->format->nbreg;
+
+  if (ModbusIsCoil(sensor->function))
+    return ((uint8_t *)a)[idx] != ((uint8_t *)b)[idx];
+  return memcmp(&a[idx * nbreg], &b[idx * nbreg], nbreg * sizeof(uint16_t)) != 0;
+}
+
+// check if a value moved by more than the channel deadband/hysteresis
+static bool ModbusSensorMoved(ModbusSensorT *sensor, ModbusChannelT *channel,
+                              ModbusSourceT *source, uint idx) {
+  double value, last, delta, threshold;
+  int8_t trend;
+
+  value = ModbusSensorValue(sensor, source, idx);
+  last = channel->values[idx];
+
+  if (isnan(value))
+    return ModbusElementDiffers(sensor, channel->buffer, sensor->buffer, idx);
+
+  // nothing sent yet
+  if (isnan(last)) {
+    channel->values[idx] = value;
+    return true;
+  }
+
+  delta = value - last;
+  trend = (delta > 0) - (delta < 0);
+  threshold = channel->deadbandpct ? fabs(last) * channel->deadband / 100.0
+                                   : channel->deadband;
+  if (trend && trend == -channel->trends[idx])
+    threshold += channel->hysteresis;
+
+  if (fabs(delta) <= threshold)
+    return false;
+
+  channel->values[idx] = value;
+  channel->trends[idx] = trend;
+  return true;
+}
+
+/**
+ * Count sensor elements which changed since the last event of a channel
+ *
+ * Without deadband nor hysteresis elements are compared raw. Otherwise
+ * values are decoded with the sensor format and compared to the last sent
+ * ones: a change is reported when it exceeds the deadband (absolute or in
+ * percent of the last sent value), plus the hysteresis when the value goes
+ * back in the opposite direction of the last reported change. Elements
+ * which do not decode as numbers fall back to raw comparison.
+ * In delta mode changed elements are flagged in channel->changed.
+ */
+static uint ModbusSensorChanges(ModbusSensorT *sensor, ModbusChannelT *channel) {
+  ModbusSourceT source;
+  uint nchanged = 0;
+  bool changed;
+
+  // whole buffer compare is enough when elements are not reported one by one
+  if (!channel->values && !channel->changed)
+    return memcmp(channel->buffer, sensor->buffer, ModbusSensorBytes(sensor)) != 0;
+
+  source.sensor = sensor->uid;
+  source.api = sensor->api;
+  source.context = sensor->context;
+
+  for (uint idx = 0; idx < sensor->count; idx++) {
+    if (channel->values)
+      changed = ModbusSensorMoved(sensor, channel, &source, idx);
+    else
+      changed = ModbusElementDiffers(sensor, channel->buffer, sensor->buffer, idx);
+    if (channel->changed)
+      channel->changed[idx] = changed;
+    nchanged += changed;
+  }
+  return nchanged;
+}
+
+// protects sensor->poll creation and release
+static pthread_mutex_t ModbusPollMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void ModbusChannelFree(ModbusChannelT *channel) {
+  if (channel->event)
+    afb_event_unref(channel->event);
+  free(channel->name);
+  free(channel->buffer);
+  free(channel->values);
+  free(channel->trends);
+  free(channel->changed);
+  free(channel);
+}
+
+/**
+ * Evaluate a channel after a poll and push its event when needed
+ *
+ * A channel is only evaluated once per its own period and never pushes more
+ * than max_rate events per second. A rate limited change stays pending
+ * until the channel may push again.
+ *
+ * @return number of subscribers reached, 0 means the channel is unused
+ */
+static int ModbusChannelPush(ModbusEvtT *poll, ModbusChannelT *channel, uint64_t now) {
+  ModbusSensorT *sensor = poll->sensor;
+  uint8_t *snapshot = (uint8_t *)alloca(ModbusSensorBytes(sensor));
+  json_object *responseJ;
+  uint nchanged;
+  int err, count;
+
+  if (!channel->probe) {
+    // the fastest channel sets the polling period, slower ones skip polls
+    if (now - channel->checked + poll->period / 2 < channel->period)
+      return -1;
+    if (channel->maxrate > 0 && (now - channel->pushed) * channel->maxrate < 1000)
+      return -1;
+  }
+
+  // the value is compared and formatted under the cache lock, a concurrent
+  // read of the block may not tear it
+  pthread_mutex_lock(&sensor->block->cache);
+
+  // raw value unchanged since a check which found nothing to send, the
+  // same answer is known without decoding every element
+  if (channel->settled && channel->checked >= sensor->prevstamp &&
+      !memcmp(sensor->previous, sensor->buffer, ModbusSensorBytes(sensor)))
+    nchanged = 0;
+  else
+    nchanged = ModbusSensorChanges(sensor, channel);
+  channel->checked = now;
+  channel->settled = !nchanged;
+
+  // if value changed then update JSON and send event, idle counter keeps
+  // sending periodic events as a heartbeat
+  if (!nchanged && !channel->probe && --channel->idle) {
+    pthread_mutex_unlock(&sensor->block->cache);
+    return -1;
+  }
+
+  // delta events carry changed elements only, a full snapshot is sent
+  // on heartbeat and every 'snapshot' events
+  if (channel->changed && nchanged && !channel->probe &&
+      channel->deltas < sensor->snapshot) {
+    err = ModbusFormatDelta(sensor, channel->changed, &responseJ);
+    channel->deltas++;
+  } else {
+    err = ModbusFormatResponse(sensor, &responseJ);
+    channel->deltas = 0;
+  }
+  memcpy(snapshot, sensor->buffer, ModbusSensorBytes(sensor));
+  pthread_mutex_unlock(&sensor->block->cache);
+  if (err)
+    return -1;
+
+  afb_data_t data = afb_data_json_c_hold(responseJ);
+  count = afb_event_push(channel->event, 1, &data);
+  if (count == 0)
+    return 0;
+
+  // save the value sent for next comparison
+  memcpy(channel->buffer, snapshot, ModbusSensorBytes(sensor));
+  channel->idle = sensor->idle; // reset idle counter
+  channel->pushed = now;
+  channel->probe = false;
+  return count;
+}
+
+// fastest period of remaining channels, 0 when none is left
+static uint ModbusPollPeriod(ModbusEvtT *poll) {
+  uint period = 0;
+
+  for (ModbusChannelT *channel = poll->channels; channel; channel = channel->next) {
+    if (!period || channel->period < period)
+      period = channel->period;
+  }
+  return period;
+}
+
+/**
+ * Fan out a sensor value to its event channels after a poll
+ *
+ * Channels without subscribers are released; when the last one leaves,
+ * the poll itself is released.
+ *
+ * @return 1 when the poll was released, 0 otherwise
+ */
+static int ModbusSensorFanout(ModbusEvtT *poll) {
+  ModbusSensorT *sensor = poll->sensor;
+  ModbusChannelT *channel, **prev;
+  uint64_t now;
+
+  now = ModbusNowMs();
+  pthread_mutex_lock(&poll->mutex);
+  for (prev = &poll->channels; (channel = *prev);) {
+    // no more client, remove channel
+    if (ModbusChannelPush(poll, channel, now) == 0) {
+      AFB_API_DEBUG(sensor->api, "ModbusSensorFanout: release event=%s", channel->name);
+      *prev = channel->next;
+      ModbusChannelFree(channel);
+      continue;
+    }
+    prev = &channel->next;
+  }
+  poll->period = ModbusPollPeriod(poll);
+  pthread_mutex_unlock(&poll->mutex);
+
+  if (poll->period)
+    return 0;
+
+  // last channel left, unless a subscription came in meanwhile
+  pthread_mutex_lock(&ModbusPollMutex);
+  pthread_mutex_lock(&poll->mutex);
+  if (poll->channels) {
+    poll->period = ModbusPollPeriod(poll);
+    pthread_mutex_unlock(&poll->mutex);
+    pthread_mutex_unlock(&ModbusPollMutex);
+    return 0;
+  }
+  sensor->poll = NULL;
+  pthread_mutex_unlock(&poll->mutex);
+  pthread_mutex_unlock(&ModbusPollMutex);
+
+  ModbusSchedulerRemove(sensor->rtu->connection, poll);
+  pthread_mutex_destroy(&poll->mutex);
+  free(poll);
+  return 1;
+}
+
+// poll read completed on the I/O thread, back on an afb job
+static void ModbusSensorPollDone(ModbusXferT *xfer) {
+  ModbusEvtT *poll = (ModbusEvtT *)xfer->data;
+  ModbusSensorT *sensor = poll->sensor;
+
+  if (xfer->status) {
+    AFB_API_ERROR(sensor->api,
+                  "ModbusSensorPoll: fail read sensor rtu=%s sensor=%s",
+                  sensor->rtu->uid, sensor->uid);
+  } else if (ModbusSensorFanout(poll)) {
+    return;
+  }
+  ModbusSchedulerRequeue(sensor->rtu->connection, poll);
+}
+
+/**
+ * Poll a subscribed sensor, called by the connection scheduler
+ *
+ * The read is queued on the connection I/O thread, interactive requests go
+ * first when both are waiting for the bus. The scheduler gets the poll
+ * back once the value was dispatched to its channels.
+ */
+void ModbusSensorPoll(ModbusEvtT *poll) {
+  ModbusSensorT *sensor = poll->sensor;
+  int err;
+
+  // skip the bus when another sensor of the same block already refreshed
+  // our buffer during this polling period
+  if (ModbusBlockIsFresh(sensor->block, poll->period / 2)) {
+    if (!ModbusSensorFanout(poll))
+      ModbusSchedulerRequeue(sensor->rtu->connection, poll);
+    return;
+  }
+
+  // silent RTU, only a probe now and then reaches the bus
+  if (!ModbusBreakerAllows(sensor->rtu, true)) {
+    ModbusSchedulerRequeue(sensor->rtu->connection, poll);
+    return;
+  }
+
+  poll->xfer.class = MB_CLASS_POLL;
+  poll->xfer.deadline = poll->deadline;
+  poll->xfer.runCB = ModbusSensorReadRun;
+  poll->xfer.doneCB = ModbusSensorPollDone;
+  poll->xfer.context = sensor;
+  poll->xfer.data = poll;
+  err = ModbusSensorReadSubmit(sensor, &poll->xfer);
+  if (err) {
+    ModbusBreakerResult(sensor->api, sensor->rtu, ENOTCONN);
+    // link not up yet or reconnecting, already reported by the link
+    if (errno != ENOTCONN)
+      AFB_API_ERROR(sensor->api,
+                    "ModbusSensorPoll: fail to queue read rtu=%s sensor=%s error=%s",
+                    sensor->rtu->uid, sensor->uid, strerror(errno));
+    ModbusSchedulerRequeue(sensor->rtu->connection, poll);
+  }
+}
+
+// create a channel, the sensor uid names the channel using sensor settings
+static ModbusChannelT *ModbusChannelCreate(ModbusSensorT *sensor, ModbusChannelT *params) {
+  ModbusChannelT *channel;
+  int err;
+
+  channel = (ModbusChannelT *)calloc(1, sizeof(ModbusChannelT));
+  if (!channel)
+    goto OnMemoryError;
+  *channel = *params;
+  channel->next = NULL;
+  channel->idle = sensor->idle;
+
+  if (channel->period == sensor->period && channel->deadband == sensor->deadband &&
+      channel->deadbandpct == sensor->deadbandpct &&
+      channel->hysteresis == sensor->hysteresis && !channel->maxrate) {
+    channel->name = strdup(sensor->uid);
+  } else {
+    err = asprintf(&channel->name, "%s/period=%u,deadband=%g%s,hysteresis=%g,max_rate=%g",
+                   sensor->uid, channel->period, channel->deadband,
+                   channel->deadbandpct ? "%" : "", channel->hysteresis, channel->maxrate);
+    if (err < 0)
+      channel->name = NULL;
+  }
+  if (!channel->name)
+    goto OnMemoryError;
+
+  // keep track of old value
+  channel->buffer =
+      (uint16_t *)calloc(sensor->format->nbreg * sensor->count, sizeof(uint16_t));
+  if (!channel->buffer)
+    goto OnMemoryError;
+
+  // deadband and hysteresis compare decoded values
+  if (channel->deadband > 0 || channel->hysteresis > 0) {
+    channel->values = (double *)malloc(sensor->count * sizeof(double));
+    channel->trends = (int8_t *)calloc(sensor->count, sizeof(int8_t));
+    if (!channel->values || !channel->trends)
+      goto OnMemoryError;
+    for (uint idx = 0; idx < sensor->count; idx++)
+      channel->values[idx] = NAN;
+  }
+
+  // delta mode tracks which elements changed
+  if (sensor->delta) {
+    channel->changed = (bool *)calloc(sensor->count, sizeof(bool));
+    if (!channel->changed)
+      goto OnMemoryError;
+  }
+
+  err = afb_api_new_event(sensor->api, channel->name, &channel->event);
+  if (err) {
+    AFB_API_ERROR(sensor->api,
+                  "ModbusChannelCreate: fail to create event rtu=%s sensor=%s",
+                  sensor->rtu->uid, sensor->uid);
+    goto OnErrorExit;
+  }
+  return channel;
+
+OnMemoryError:
+  AFB_API_ERROR(sensor->api, "ModbusChannelCreate: out of memory");
+OnErrorExit:
+  if (channel)
+    ModbusChannelFree(channel);
+  return NULL;
+}
+
+/**
+ * Find or create the event channel matching subscription parameters
+ *
+ * Subscribers asking for the same period and filters share one event. The
+ * sensor is polled at the fastest period of its channels, a faster
+ * subscription reschedules the poll right away.
+ *
+ * @param sensor sensor to subscribe to
+ * @param params channel period and filters
+ * @return channel event, NULL on error
+ */
+static afb_event_t ModbusSensorChannel(ModbusSensorT *sensor, ModbusChannelT *params) {
+  ModbusRtuT *rtu = sensor->rtu;
+  ModbusChannelT *channel;
+  ModbusEvtT *poll;
+  afb_event_t event = NULL;
+  int err;
+
+  pthread_mutex_lock(&ModbusPollMutex);
+  poll = sensor->poll;
+  if (!poll) {
+    poll = (ModbusEvtT *)calloc(1, sizeof(ModbusEvtT));
+    if (!poll) {
+      AFB_API_ERROR(sensor->api, "ModbusSensorChannel: out of memory");
+      goto OnErrorExit;
+    }
+    poll->sensor = sensor;
+    pthread_mutex_init(&poll->mutex, NULL);
+  }
+
+  pthread_mutex_lock(&poll->mutex);
+  for (channel = poll->channels; channel; channel = channel->next) {
+    if (channel->period == params->period && channel->deadband == params->deadband &&
+        channel->deadbandpct == params->deadbandpct &&
+        channel->hysteresis == params->hysteresis && channel->maxrate == params->maxrate)
       break;
   }
+  if (!channel) {
+    channel = ModbusChannelCreate(sensor, params);
+    if (channel) {
+      channel->next = poll->channels;
+      poll->channels = channel;
+    }
+  }
+  if (channel)
+    event = channel->event;
+  pthread_mutex_unlock(&poll->mutex);
+
+  if (!channel) {
+    if (!sensor->poll) {
+      pthread_mutex_destroy(&poll->mutex);
+      free(poll);
+    }
+    goto OnErrorExit;
+  }
 
-  return (&ModbusFunctionsCB[idx]);
+  if (!sensor->poll) {
+    // every periodic read of the link is serialized by its scheduler
+    poll->period = params->period;
+    err = ModbusSchedulerAdd(sensor->api, rtu->connection, poll);
+    if (err) {
+      AFB_API_ERROR(sensor->api,
+                    "ModbusSensorChannel: fail to schedule polling rtu=%s sensor=%s",
+                    rtu->uid, sensor->uid);
+      poll->channels = NULL;
+      ModbusChannelFree(channel);
+      pthread_mutex_destroy(&poll->mutex);
+      free(poll);
+      goto OnErrorExit;
+    }
+    sensor->poll = poll;
+  } else if (params->period < poll->period) {
+    pthread_mutex_lock(&poll->mutex);
+    poll->period = params->period;
+    pthread_mutex_unlock(&poll->mutex);
+    ModbusSchedulerUpdate(rtu->connection, poll);
+  }
+
+  pthread_mutex_unlock(&ModbusPollMutex);
+  return event;
+
+OnErrorExit:
+  pthread_mutex_unlock(&ModbusPollMutex);
+  return NULL;
 }
 
-// Timer base sensor polling tic send event if sensor value changed
-static void ModbusTimerCallback(afb_timer_t timer, void *userdata,
-                               uint decount) {
+// parse subscription parameters, sensor settings are the defaults
+static int ModbusSubscribeParams(ModbusSensorT *sensor, json_object *argsJ,
+                                 ModbusChannelT *params) {
+  json_object *deadbandJ = NULL;
+  uint period = 0;
+  int err;
 
-  ModbusEvtT *context = (ModbusEvtT *)userdata;
-  ModbusSensorT *sensor = context->sensor;
-  json_object *responseJ;
-  int err, count;
+  memset(params, 0, sizeof(ModbusChannelT));
+  params->period = sensor->period;
+  params->deadband = sensor->deadband;
+  params->deadbandpct = sensor->deadbandpct;
+  params->hysteresis = sensor->hysteresis;
 
-  // update sensor buffer with current value without building JSON
-  err = (sensor->function->readCB)(sensor, NULL);
+  if (!argsJ)
+    return 0;
 
-  if (err) {
-    AFB_API_ERROR(sensor->api,
-                  "ModbusTimerCallback: fail read sensor rtu=%s sensor=%s",
-                  sensor->rtu->uid, sensor->uid);
+  err = ParsePollingPeriod(sensor->api, argsJ, &period);
+  if (err < 0)
     goto OnErrorExit;
-  }
+  if (period > 0)
+    params->period = period;
 
-  // if buffer change then update JSON and send event
-  if (memcmp(context->buffer, sensor->buffer,
-             sizeof(uint16_t) * sensor->format->nbreg * sensor->count) ||
-      !--context->idle) {
+  err = rp_jsonc_unpack(argsJ, "{s?o s?F s?F}", "deadband", &deadbandJ,
+                        "hysteresis", &params->hysteresis, "max_rate", &params->maxrate);
+  if (err)
+    goto OnErrorExit;
 
-    // if responseJ is provided build JSON response
-    err = ModbusFormatResponse(sensor, &responseJ);
-    if (err)
-      goto OnErrorExit;
+  err = ParseDeadband(sensor->api, deadbandJ, &params->deadband, &params->deadbandpct);
+  if (err)
+    goto OnErrorExit;
 
-    // send event and it no more client remove event and timer
-    afb_data_t data = afb_data_json_c_hold(responseJ);
-    count = afb_event_push(sensor->event, 1, &data);
-    if (count == 0) {
-      afb_event_unref(sensor->event);
-      sensor->event = NULL;
-      afb_timer_unref(timer);
-      sensor->timer=NULL;
-      free(context->buffer);
-    } else {
-      // save current sensor buffer for next comparison
-      memcpy(context->buffer, sensor->buffer,
-             sizeof(uint16_t) * sensor->format->nbreg * sensor->count);
-      context->idle = sensor->idle; // reset idle counter
-    }
-  }
-  return;
+  if (params->hysteresis < 0 || params->maxrate < 0)
+    goto OnErrorExit;
+  return 0;
 
 OnErrorExit:
-  return;
+  AFB_API_ERROR(sensor->api, "ModbusSubscribeParams: invalid subscription sensor=%s args=%s",
+                sensor->uid, json_object_get_string(argsJ));
+  return -1;
 }
 
-static int ModbusSensorEventCreate(ModbusSensorT *sensor,
-                                   json_object **responseJ) {
-  ModbusRtuT *rtu = sensor->rtu;
+// the subscription reply carries a first value, read once subscribed
+static int ModbusSensorEventCreate(ModbusSensorT *sensor, json_object *argsJ,
+                                   afb_event_t *event) {
+  ModbusChannelT params;
   int err;
-  ModbusEvtT *mbEvtHandle;
 
   if (!sensor->function->readCB)
     goto OnErrorExit;
 
-  err = (sensor->function->readCB)(sensor, responseJ);
-  if (err) {
-    AFB_API_WARNING(sensor->api,
-                  "ModbusSensorEventCreate: fail read sensor rtu=%s sensor=%s",
-                  rtu->uid, sensor->uid);
-  }
+  err = ModbusSubscribeParams(sensor, argsJ, &params);
+  if (err)
+    goto OnErrorExit;
 
-  // if no even attach to sensor create one
-  if (!sensor->event) {
-    err = afb_api_new_event(sensor->api, sensor->uid, &sensor->event);
-    if (err) {
-      AFB_API_ERROR(
-          sensor->api,
-          "ModbusSensorEventCreate: fail to create event rtu=%s sensor=%s",
-          rtu->uid, sensor->uid);
-      goto OnErrorExit;
-    }
+  *event = ModbusSensorChannel(sensor, &params);
+  if (!*event)
+    goto OnErrorExit;
+  return 0;
 
-    mbEvtHandle = (ModbusEvtT *)calloc(1, sizeof(ModbusEvtT));
-    if (!mbEvtHandle) {
-      AFB_API_ERROR(sensor->api, "ModbusSensorEventCreate: out of memory");
-      goto OnErrorExit;
+OnErrorExit:
+  return 1;
+}
+
+// unsubscribe from every channel, next poll checks which ones are still used
+static void ModbusSensorEventRemove(afb_req_t request, ModbusSensorT *sensor) {
+  ModbusChannelT *channel;
+
+  pthread_mutex_lock(&ModbusPollMutex);
+  if (sensor->poll) {
+    pthread_mutex_lock(&sensor->poll->mutex);
+    for (channel = sensor->poll->channels; channel; channel = channel->next) {
+      afb_req_unsubscribe(request, channel->event);
+      channel->probe = true;
     }
-    mbEvtHandle->sensor = sensor;
-    mbEvtHandle->idle = sensor->idle;
-    mbEvtHandle->buffer =
-        (uint16_t *)calloc(sensor->format->nbreg * sensor->count,
-                           sizeof(uint16_t)); // keep track of old value
-    if (!mbEvtHandle->buffer) {
-      AFB_API_ERROR(sensor->api, "ModbusSensorEventCreate: out of memory");
+    pthread_mutex_unlock(&sensor->poll->mutex);
+  }
+  pthread_mutex_unlock(&ModbusPollMutex);
+}
+
+// asynchronous READ/WRITE request, alive until replied
+typedef struct {
+  ModbusXferT xfer;     // first member, completion gets the request back
+  afb_req_t request;
+  ModbusSensorT *sensor;
+  json_object *dataJ;
+  bool write;
+  bool subscribe;       // first read of a subscription, replied with the value only
+} ModbusRequestT;
+
+// bus transaction completed, reply to the client from the afb loop
+static void ModbusRequestDone(ModbusXferT *xfer) {
+  ModbusRequestT *pending = (ModbusRequestT *)xfer;
+  ModbusSensorT *sensor = pending->sensor;
+  ModbusRtuT *rtu = sensor->rtu;
+  json_object *responseJ = NULL, *metaJ = NULL;
+  int err;
+
+  errno = xfer->error;
+  if (xfer->status)
+    goto OnErrorExit;
+
+  if (pending->subscribe) {
+    err = ModbusCacheFormat(sensor, 0, &responseJ, &metaJ);
+    if (err)
       goto OnErrorExit;
-    }
-    err = afb_timer_create(&sensor->timer, 0, 0, 0,
-                           0, // run forever,
-                           sensor->period, 0, ModbusTimerCallback,
-                           mbEvtHandle, 1);
+    json_object_put(metaJ);
+    afb_data_t repldata = afb_data_json_c_hold(responseJ);
+    afb_req_reply(pending->request, 0, 1, &repldata);
+    goto OnExit;
+  }
 
-    if (err != 0) {
-      AFB_API_ERROR(
-          sensor->api,
-          "ModbusSensorTimerCreate: fail to create timer rtu=%s sensor=%s",
-          rtu->uid, sensor->uid);
+  if (!pending->write) {
+    err = ModbusCacheFormat(sensor, 0, &responseJ, &metaJ);
+    if (err)
       goto OnErrorExit;
-    }
+    ModbusReadReply(pending->request, responseJ, metaJ);
+    goto OnExit;
   }
-  return 0;
+
+  afb_data_t repldata = afb_data_json_c_hold(responseJ);
+  afb_req_reply(pending->request, 0, 1, &repldata);
+  goto OnExit;
 
 OnErrorExit:
-  return 1;
+  if (pending->subscribe) {
+    // subscribed anyway, events follow once the sensor answers
+    AFB_API_WARNING(sensor->api, "ModbusSensorEventCreate: fail read sensor rtu=%s sensor=%s",
+                    rtu->uid, sensor->uid);
+    afb_data_t repldata = afb_data_json_c_hold(NULL);
+    afb_req_reply(pending->request, 0, 1, &repldata);
+  } else if (pending->write) {
+    afb_req_reply_string_f(pending->request, AFB_ERRNO_INTERNAL_ERROR,
+        "write-error, ModbusSensorRequest: fail to write data=%s rtu=%s sensor=%s error=%s",
+        json_object_get_string(pending->dataJ), rtu->uid, sensor->uid, modbus_strerror(errno));
+  } else {
+    afb_req_reply_string_f(pending->request,
+        errno == ETIMEDOUT ? AFB_USER_ERRNO(1) : AFB_ERRNO_INTERNAL_ERROR,
+        "read-error, ModbusSensorRequest: fail to read rtu=%s sensor=%s error=%s",
+        rtu->uid, sensor->uid, modbus_strerror(errno));
+  }
+
+OnExit:
+  afb_req_unref(pending->request);
+  json_object_put(pending->dataJ);
+  free(pending);
+}
+
+/**
+ * Queue a READ, WRITE or SUBSCRIBE first read on the connection I/O thread
+ * and reply later
+ *
+ * The binder thread returns immediately, the reply is sent from the
+ * completion. Reads go to the native TCP engine when the link has one.
+ * With a timeout, the transaction is ordered by its deadline and dropped
+ * with ETIMEDOUT if it has not reached the bus in time.
+ *
+ * @return 0 when queued, -1 when the caller must reply
+ */
+static int ModbusRequestSubmit(afb_req_t request, ModbusSensorT *sensor,
+                               json_object *dataJ, bool write, bool subscribe,
+                               int timeout) {
+  ModbusRequestT *pending;
+  uint64_t now = ModbusNowMs();
+  int err;
+
+  pending = (ModbusRequestT *)calloc(1, sizeof(ModbusRequestT));
+  if (!pending) {
+    errno = ENOMEM;
+    return -1;
+  }
+  pending->request = afb_req_addref(request);
+  pending->sensor = sensor;
+  pending->dataJ = json_object_get(dataJ);
+  pending->write = write;
+  pending->subscribe = subscribe;
+
+  pending->xfer.class = write ? MB_CLASS_WRITE : MB_CLASS_READ;
+  pending->xfer.deadline = timeout > 0 ? now + timeout : now;
+  pending->xfer.expire = timeout > 0 ? now + timeout : 0;
+  pending->xfer.doneCB = ModbusRequestDone;
+  pending->xfer.context = sensor;
+  pending->xfer.data = dataJ;
+  if (!write)
+    pending->xfer.runCB = ModbusSensorReadRun;
+  else if (ModbusIsCoil(sensor->function))
+    pending->xfer.runCB = ModbusWriteBitsRun;
+  else
+    pending->xfer.runCB = ModbusWriteRegistersRun;
+
+  if (write)
+    err = ModbusXferSubmit(sensor->rtu->connection, &pending->xfer);
+  else
+    err = ModbusSensorReadSubmit(sensor, &pending->xfer);
+  if (err) {
+    afb_req_unref(pending->request);
+    json_object_put(pending->dataJ);
+    free(pending);
+    return -1;
+  }
+  return 0;
 }
 
 void ModbusSensorRequest(afb_req_t request, ModbusSensorT *sensor,
@@ -535,10 +2223,12 @@ void ModbusSensorRequest(afb_req_t request, ModbusSensorT *sensor,
   assert(sensor->rtu);
   ModbusRtuT *rtu = sensor->rtu;
   const char *action;
-  json_object *dataJ, *responseJ = NULL;
+  json_object *dataJ = NULL, *responseJ = NULL, *metaJ = NULL;
+  int timeout = 0, maxage = 0;
   int err;
 
-  if (!rtu->connection->context) {
+  if (atomic_load_explicit(&rtu->connection->connecting, memory_order_acquire) ||
+      !rtu->connection->context) {
     afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
         "not-connected, ModbusSensorRequest: RTU not connected rtu=%s sensor=%s query=%s",
         rtu->uid, sensor->uid, json_object_get_string(queryJ));
@@ -546,7 +2236,8 @@ void ModbusSensorRequest(afb_req_t request, ModbusSensorT *sensor,
   };
 
   err =
-      rp_jsonc_unpack(queryJ, "{ss s?o !}", "action", &action, "data", &dataJ);
+      rp_jsonc_unpack(queryJ, "{ss s?o s?i s?i !}", "action", &action, "data", &dataJ,
+                      "timeout", &timeout, "max_age", &maxage);
   if (err) {
     afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
         "querry-error, ModbusSensorRequest: invalid 'json' rtu=%s sensor=%s query=%s",
@@ -554,37 +2245,53 @@ void ModbusSensorRequest(afb_req_t request, ModbusSensorT *sensor,
     goto OnErrorExit;
   }
 
+  // reads and writes are replied from their completion
   if (!strcasecmp(action, "WRITE")) {
     if (!sensor->function->writeCB)
       goto OnWriteError;
 
-    err = (sensor->function->writeCB)(sensor, dataJ);
+    err = ModbusRequestSubmit(request, sensor, dataJ, true, false, timeout);
     if (err)
       goto OnWriteError;
+    return;
 
   } else if (!strcasecmp(action, "READ")) {
     if (!sensor->function->readCB)
       goto OnReadError;
 
-    err = (sensor->function->readCB)(sensor, &responseJ);
+    // value fresh enough for the client, the bus is not touched
+    if (maxage > 0 && !ModbusCacheFormat(sensor, maxage, &responseJ, &metaJ)) {
+      ModbusReadReply(request, responseJ, metaJ);
+      return;
+    }
+
+    // offline RTU, answer at once with the last value read
+    if (!ModbusBreakerAllows(rtu, false)) {
+      ModbusBreakerReply(request, sensor);
+      return;
+    }
+
+    err = ModbusRequestSubmit(request, sensor, NULL, false, false, timeout);
     if (err)
       goto OnReadError;
+    return;
 
   } else if (!strcasecmp(action, "SUBSCRIBE")) {
-    err = ModbusSensorEventCreate(sensor, &responseJ);
+    afb_event_t event;
+    err = ModbusSensorEventCreate(sensor, dataJ, &event);
     if (err)
       goto OnSubscribeError;
-    err = afb_req_subscribe(request, sensor->event);
+    err = afb_req_subscribe(request, event);
     if (err)
       goto OnSubscribeError;
 
-  } else if (!strcasecmp(action, "UNSUBSCRIBE")) { // Fulup ***** Virer l'event
-                                                   // quand le count est à zero
-    if (sensor->event) {
-      err = afb_req_unsubscribe(request, sensor->event);
-      if (err)
-        goto OnSubscribeError;
-    }
+    // first value is replied from the read completion, none while offline
+    if (ModbusBreakerAllows(rtu, false) &&
+        !ModbusRequestSubmit(request, sensor, NULL, false, true, 0))
+      return;
+
+  } else if (!strcasecmp(action, "UNSUBSCRIBE")) {
+    ModbusSensorEventRemove(request, sensor);
   } else {
     afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
         "syntax-error, ModbusSensorRequest: action='%s' UNKNOWN rtu=%s sensor=%s query=%s",
@@ -651,49 +2358,118 @@ OnErrorExit:
   return 1;
 }
 
-static int ModbusParseURI(const char *uri, char **addr, int *port) {
+// split tcp://host[:port] or tcp://[ipv6]:port, the host is not resolved here
+int ModbusParseURI(const char *uri, char **host, int *port) {
 #define TCP_PREFIX "tcp://"
-  char *hostaddr, *tcpport, *uri_tmp;
-  int idx;
   static int prefixlen = sizeof(TCP_PREFIX) - 1;
-  char ip[100];
-  struct hostent *he;
-  struct in_addr **addrlist;
+  const char *target, *suffix;
 
   if (strncasecmp(uri, TCP_PREFIX, prefixlen))
     goto OnErrorExit;
-  uri_tmp = strdup(uri);
-  // break URI in substring ignoring leading tcp:
-  for (idx = prefixlen; idx < strlen(uri_tmp); idx++) {
-    if (uri_tmp[idx] == 0)
-      break;
-    if (uri_tmp[idx] == ':')
-      uri_tmp[idx] = 0;
-  }
-
-  // extract IP addr and port
-  hostaddr = &uri_tmp[prefixlen];
-  tcpport = &uri_tmp[idx];
-  sscanf(tcpport, "%d", port);
-
-  if ((he = gethostbyname(hostaddr)) == NULL)
-    goto OnErrorExit;
+  target = &uri[prefixlen];
 
-  addrlist = (struct in_addr **)he->h_addr_list;
-  for (idx = 0; addrlist[idx] != NULL; idx++) {
-    // Return the first one;
-    strcpy(ip, inet_ntoa(*addrlist[idx]));
-    break;
+  if (*target == '[') {
+    suffix = strchr(target, ']');
+    if (!suffix)
+      goto OnErrorExit;
+    *host = strndup(target + 1, suffix - target - 1);
+    suffix++;
+  } else {
+    suffix = strchr(target, ':');
+    *host = suffix ? strndup(target, suffix - target) : strdup(target);
   }
+  if (!*host)
+    goto OnErrorExit;
 
-  *addr = strdup(ip);
-  free(uri_tmp);
+  *port = 502;
+  if (suffix && *suffix == ':')
+    sscanf(suffix + 1, "%d", port);
   return 0;
 
 OnErrorExit:
   return 1;
 }
 
+/**
+ * Normalized form of a connection URI, used to detect RTUs sharing a link
+ *
+ * Scheme and TCP host are lowercased, default TCP port (502) and serial
+ * speed (19200) are made explicit. Unknown schemes are kept as is.
+ *
+ * @return allocated string, NULL when out of memory
+ */
+char *ModbusNormalizeURI(const char *uri) {
+  char *normalized = NULL, *target, *suffix;
+  bool tcp = !strncasecmp(uri, "tcp://", 6);
+  int value = 0, err;
+
+  if (!tcp && strncasecmp(uri, "tty://", 6))
+    return strdup(uri);
+
+  // host or device, then port or speed after the last ':'
+  target = strdup(uri + 6);
+  if (!target)
+    return NULL;
+  suffix = strrchr(target, ':');
+  if (suffix && !strchr(suffix, ']')) {
+    *suffix = 0;
+    value = atoi(suffix + 1);
+  }
+
+  if (tcp) {
+    for (char *pt = target; *pt; pt++)
+      *pt = tolower(*pt);
+    err = asprintf(&normalized, "tcp://%s:%d", target, value ? value : 502);
+  } else {
+    // device path is case sensitive
+    err = asprintf(&normalized, "tty://%s:%d", target, value ? value : 19200);
+  }
+  free(target);
+  return err < 0 ? NULL : normalized;
+}
+
+// serial link speed from connection URI, 0 for TCP links
+int ModbusConnectionBaud(ModbusConnectionT *connection) {
+  char *ttydev = NULL;
+  int speed = 19200;
+
+  if (!connection->baud && connection->uri &&
+      !ModbusParseTTY(connection->uri, &ttydev, &speed)) {
+    connection->baud = speed;
+    free(ttydev);
+  }
+  return connection->baud;
+}
+
+/**
+ * Open the extra sockets of a TCP pool
+ *
+ * Members share the pool head URI and pipeline setting, each one gets its
+ * own libmodbus context and I/O thread. A gateway refusing some of them
+ * only shrinks the pool, members lost on disconnect are reopened here.
+ */
+static void ModbusPoolConnect(afb_api_t api, ModbusConnectionT *connection,
+                              const char *rtu_uid) {
+  ModbusConnectionT **member = &connection->next;
+  uint count = 1;
+
+  for (; count < connection->connections; count++, member = &(*member)->next) {
+    if (!*member) {
+      *member = (ModbusConnectionT *)calloc(1, sizeof(ModbusConnectionT));
+      if (!*member) {
+        AFB_API_ERROR(api, "ModbusPoolConnect: out of memory");
+        break;
+      }
+    }
+    (*member)->uri = connection->uri;
+    (*member)->pipeline = connection->pipeline;
+    if (!(*member)->context && ModbusRtuConnect(api, *member, rtu_uid)) {
+      AFB_API_WARNING(api, "ModbusPoolConnect: gateway refused socket %d/%d uid=%s uri=%s",
+                      count + 1, connection->connections, rtu_uid, connection->uri);
+    }
+  }
+}
+
 int ModbusRtuConnect(afb_api_t api, ModbusConnectionT *connection, const char *rtu_uid) {
   modbus_t *ctx;
 
@@ -706,6 +2482,7 @@ int ModbusRtuConnect(afb_api_t api, ModbusConnectionT *connection, const char *r
       goto OnErrorExit;
     }
 
+    connection->baud = speed;
     ctx = modbus_new_rtu(ttydev, speed, 'N', 8, 1);
     if (modbus_connect(ctx) == -1) {
       AFB_API_ERROR(
@@ -724,35 +2501,55 @@ int ModbusRtuConnect(afb_api_t api, ModbusConnectionT *connection, const char *r
           api,
           "ModbusRtuConnect: fail to lock tty device uid=%s ttydev=%s, %s",
           rtu_uid, ttydev, errno == EWOULDBLOCK ? "device already in use" : "fatal error");
-      return 1;
-    }
-
-    // serial link do not support simultaneous read
-    connection->semaphore = malloc (sizeof(sem_t));
-    if (!connection->semaphore) {
-      AFB_API_ERROR(api, "ModbusRtuConnect: out of memory");
+      modbus_close(ctx);
+      modbus_free(ctx);
       goto OnErrorExit;
     }
-    int err = sem_init(connection->semaphore, 0, 1);
-    if (err < 0) {
-        AFB_API_ERROR(api, "ModbusRtuConnect: fail to init tty semaphore uid=%s uri=%s",
-                    rtu_uid, connection->uri);
-        goto OnErrorExit;
-    }
 
   } else {
-    char *addr;
+    char *host;
     int port;
-    if (ModbusParseURI(connection->uri, &addr, &port)) {
+    char service[16];
+    if (ModbusParseURI(connection->uri, &host, &port)) {
       AFB_API_ERROR(api, "ModbusRtuConnect: fail to parse uid=%s uri=%s",
                     rtu_uid, connection->uri);
       goto OnErrorExit;
     }
-    ctx = modbus_new_tcp(addr, port);
-    if (modbus_connect(ctx) == -1) {
+    // libmodbus only gets the socket, names go through the resolver cache
+    snprintf(service, sizeof(service), "%d", port);
+    ctx = modbus_new_tcp_pi(host, service);
+    if (!ctx || ModbusLinkOpenTcp(api, connection, ctx)) {
       AFB_API_ERROR(
-          api, "ModbusRtuConnect: fail to connect TCP uid=%s addr=%s port=%d",
-          rtu_uid, addr, port);
+          api, "ModbusRtuConnect: fail to connect TCP uid=%s host=%s port=%d error=%s",
+          rtu_uid, host, port, strerror(errno));
+      if (ctx)
+        modbus_free(ctx);
+      free(host);
+      goto OnErrorExit;
+    }
+
+    // opt-in pipelined reads on a second socket, libmodbus stays the
+    // fallback for writes, split reads and diagnostics
+    if (connection->pipeline && !connection->tcp) {
+      connection->tcp = ModbusTcpCreate(api, connection, host, port, connection->pipeline);
+      if (!connection->tcp)
+        AFB_API_WARNING(api, "ModbusRtuConnect: native TCP engine disabled uid=%s uri=%s",
+                        rtu_uid, connection->uri);
+    } else if (connection->tcp && (ModbusTcpTarget(connection->tcp, host, port) ||
+                                   ModbusTcpReopen(connection->tcp))) {
+      // closed by disconnect, a failed native read reopens it through the link reconnect
+      AFB_API_WARNING(api, "ModbusRtuConnect: native TCP engine not reopened uid=%s uri=%s",
+                      rtu_uid, connection->uri);
+    }
+    free(host);
+  }
+
+  // neither serial links nor libmodbus contexts support simultaneous
+  // transactions, a TCP pool gets one I/O thread per socket
+  if (!connection->worker) {
+    connection->worker = ModbusWorkerStart(api, connection);
+    if (!connection->worker) {
+      modbus_close(ctx);
       modbus_free(ctx);
       goto OnErrorExit;
     }
@@ -760,6 +2557,17 @@ int ModbusRtuConnect(afb_api_t api, ModbusConnectionT *connection, const char *r
 
   // store current libmodbus ctx with rtu handle
   connection->context = (void *)ctx;
+  connection->timeouts = 0;
+  connection->backoff = 0;
+  connection->state = MB_LINK_CONNECTED;
+
+  if (connection->connections > 1) {
+    if (connection->baud)
+      AFB_API_WARNING(api, "ModbusRtuConnect: connections ignored on serial link uid=%s uri=%s",
+                      rtu_uid, connection->uri);
+    else
+      ModbusPoolConnect(api, connection, rtu_uid);
+  }
   return 0;
 
 OnErrorExit:
@@ -767,43 +2575,17 @@ OnErrorExit:
 }
 
 int ModbusRtuSetSlave(afb_api_t api, ModbusRtuT *rtu) {
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
-
-  if (rtu->slaveid) {
-    if (modbus_set_slave(ctx, rtu->slaveid) == -1) {
-      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set slaveid=%d uid=%s",
-                    rtu->slaveid, rtu->uid);
-      modbus_free(ctx);
-      goto OnErrorExit;
-    }
-  }
-
-  if (rtu->timeout) {
-    if (modbus_set_response_timeout(ctx, 0, rtu->timeout * 1000) == -1) {
-      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set timeout=%d uid=%s",
-                    rtu->timeout, rtu->uid);
-      modbus_free(ctx);
-      goto OnErrorExit;
-    }
-  }
+  ModbusConnectionT *link;
 
-  if (rtu->debug) {
-    if (modbus_set_debug(ctx, rtu->debug) == -1) {
-      AFB_API_ERROR(api, "ModbusRtuSetSlave: fail to set debug=%d uid=%s",
-                    rtu->debug, rtu->uid);
-      modbus_free(ctx);
-      goto OnErrorExit;
-    }
+  for (link = rtu->connection; link; link = link->next) {
+    if (link->context && ModbusLinkSetSlave(api, rtu, (modbus_t *)link->context))
+      return 1;
   }
-
   return 0;
-
-OnErrorExit:
-  return 1;
 }
 
 void ModbusRtuSensorsId(ModbusRtuT *rtu, int verbose, json_object *responseJ) {
-  json_object *elemJ, *dataJ, *actionsJ;
+  json_object *elemJ, *dataJ, *metaJ, *actionsJ;
   ModbusSensorT *sensor;
   int err = 0;
 
@@ -819,10 +2601,11 @@ void ModbusRtuSensorsId(ModbusRtuT *rtu, int verbose, json_object *responseJ) {
                            sensor->format->nbreg * sensor->count);
       break;
     case 2:
-      err += (sensor->function->readCB)(sensor, &dataJ);
-
-      if (err)
+      // last value read, the admin info action refreshes them first
+      if (ModbusCacheFormat(sensor, 0, &dataJ, &metaJ))
         dataJ = NULL;
+      else
+        json_object_put(metaJ);
       err = rp_jsonc_pack(&elemJ, "{ss ss ss si si so}", "uid", sensor->uid,
                           "type", sensor->function->uid, "format",
                           sensor->format->uid, "count", sensor->count, "nbreg",
@@ -869,43 +2652,205 @@ void ModbusRtuSensorsId(ModbusRtuT *rtu, int verbose, json_object *responseJ) {
   }
 }
 
-int ModbusRtuIsConnected(afb_api_t api, ModbusRtuT *rtu) {
-  uint8_t response[MODBUS_MAX_PDU_LENGTH];
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
-  int run;
+// RTU reachable from the state kept by its link and breaker, no bus access
+bool ModbusRtuIsOnline(ModbusRtuT *rtu) {
+  bool online;
 
-  if (ModbusRtuSetSlave(api, rtu)) {
-    AFB_API_ERROR(api, "ModbusLoadOne: failed to set slave ID uid=%s uri=%s",
-                  rtu->uid, rtu->connection->uri);
-    goto OnErrorExit;
+  if (!rtu->connection->context || !ModbusLinkUsable(rtu->connection))
+    return false;
+  pthread_mutex_lock(&rtu->mutex);
+  online = rtu->breakerstate != MB_BREAKER_OPEN;
+  pthread_mutex_unlock(&rtu->mutex);
+  return online;
+}
+
+// I/O thread side of disconnect, no transaction may use the context anymore
+static int ModbusRtuDisconnectRun(ModbusXferT *xfer) {
+  ModbusConnectionT *connection = xfer->link;
+  modbus_t *ctx = (modbus_t *)connection->context;
+
+  // stops background reconnects as well
+  connection->state = MB_LINK_DOWN;
+  if (connection->tcp)
+    ModbusTcpClose(connection->tcp);
+  if (ctx) {
+    modbus_close(ctx);
+    modbus_free(ctx);
+    connection->context = NULL;
   }
+  return 0;
+}
 
-  ModbusRtuSemWait(api, rtu);
-  run = modbus_report_slave_id(ctx, sizeof(response), response);
-  if (rtu->connection->semaphore) sem_post (rtu->connection->semaphore);
+// closes every socket of a pool, waits for their I/O threads
+void ModbusRtuDisconnect(afb_api_t api, ModbusConnectionT *connection) {
+  for (ModbusConnectionT *link = connection; link; link = link->next) {
+    ModbusXferT xfer = {.class = MB_CLASS_DIAG, .deadline = ModbusNowMs(),
+                        .runCB = ModbusRtuDisconnectRun, .link = link};
+    if (link->worker && ModbusXferRun(link, &xfer))
+      AFB_API_ERROR(api, "ModbusRtuDisconnect: fail to close uri=%s", link->uri);
+  }
+}
 
-  if (run < 0) {
-    // handle case where RTU does not support "Report Server ID"
-    if (errno == EMBXILFUN)
-      return 1;
-    else
-      goto OnErrorExit;
+typedef struct {
+  afb_req_t request;
+  ModbusRtuT *rtu;
+} ModbusAdminConnectT;
+
+// admin connect off the event loop, replies to the pending request
+static void *ModbusAdminConnectThread(void *arg) {
+  ModbusAdminConnectT *job = (ModbusAdminConnectT *)arg;
+  ModbusRtuT *rtu = job->rtu;
+  afb_api_t api = afb_req_get_api(job->request);
+
+  if (ModbusRtuConnect(api, rtu->connection, rtu->uid)) {
+    afb_req_reply_string_f(job->request, AFB_ERRNO_INTERNAL_ERROR,
+        "ModbusRtuAdmin, fail to connect: rtu=%s uri=%s", rtu->uid, rtu->connection->uri);
+  } else if (atomic_load(&rtu->connection->abandoned)) {
+    // disconnected by admin while connecting, the last action wins
+    ModbusRtuDisconnect(api, rtu->connection);
+    afb_req_reply_string_f(job->request, AFB_ERRNO_INTERNAL_ERROR,
+        "ModbusRtuAdmin, disconnected meanwhile: rtu=%s uri=%s", rtu->uid, rtu->connection->uri);
+  } else if (ModbusRtuSetSlave(api, rtu)) {
+    afb_req_reply_string_f(job->request, AFB_ERRNO_INTERNAL_ERROR,
+        "ModbusRtuAdmin, failed to set slave ID rtu=%s uri=%s", rtu->uid, rtu->connection->uri);
+  } else {
+    afb_req_reply(job->request, 0, 0, NULL);
   }
 
-  if (run > 0)
-    return 1;
-  else
-    return 0;
+  atomic_store_explicit(&rtu->connection->connecting, false, memory_order_release);
+  afb_req_unref(job->request);
+  free(job);
+  return NULL;
+}
 
-OnErrorExit:
-  AFB_API_ERROR(
-      api, "ModbusRtuIsConnected: fail to get RTU=%s connection status err=%s",
-      rtu->uid, modbus_strerror(errno));
-  return -1;
+static int ModbusAdminConnectStart(afb_req_t request, ModbusRtuT *rtu) {
+  ModbusAdminConnectT *job;
+  pthread_t thread;
+
+  job = (ModbusAdminConnectT *)calloc(1, sizeof(ModbusAdminConnectT));
+  if (!job)
+    return -1;
+  job->request = afb_req_addref(request);
+  job->rtu = rtu;
+  atomic_store(&rtu->connection->abandoned, false);
+  atomic_store(&rtu->connection->connecting, true);
+  if (pthread_create(&thread, NULL, ModbusAdminConnectThread, job)) {
+    atomic_store(&rtu->connection->connecting, false);
+    afb_req_unref(request);
+    free(job);
+    return -1;
+  }
+  pthread_detach(thread);
+  return 0;
+}
+
+// admin action spread over several transactions, the last one replies
+typedef struct ModbusAdminBatchS {
+  afb_req_t request;
+  ModbusRtuT *rtu;
+  void (*replyCB)(struct ModbusAdminBatchS *batch);
+  atomic_uint pending;  // transactions not completed, plus one while queuing
+  ModbusXferT xfers[];
+} ModbusAdminBatchT;
+
+static void ModbusAdminBatchRelease(ModbusAdminBatchT *batch) {
+  if (atomic_fetch_sub(&batch->pending, 1) != 1)
+    return;
+  batch->replyCB(batch);
+  afb_req_unref(batch->request);
+  free(batch);
+}
+
+static void ModbusAdminBatchDone(ModbusXferT *xfer) {
+  ModbusAdminBatchRelease((ModbusAdminBatchT *)xfer->data);
+}
+
+static ModbusAdminBatchT *ModbusAdminBatchCreate(afb_req_t request, ModbusRtuT *rtu,
+                                                 uint count,
+                                                 void (*replyCB)(ModbusAdminBatchT *)) {
+  ModbusAdminBatchT *batch;
+
+  batch = (ModbusAdminBatchT *)calloc(1, sizeof(ModbusAdminBatchT) + count * sizeof(ModbusXferT));
+  if (!batch)
+    return NULL;
+  batch->request = afb_req_addref(request);
+  batch->rtu = rtu;
+  batch->replyCB = replyCB;
+  atomic_init(&batch->pending, count + 1);
+  for (uint idx = 0; idx < count; idx++) {
+    batch->xfers[idx].deadline = ModbusNowMs();
+    batch->xfers[idx].doneCB = ModbusAdminBatchDone;
+    batch->xfers[idx].data = batch;
+  }
+  return batch;
+}
+
+static void ModbusAdminInfoReply(ModbusAdminBatchT *batch) {
+  json_object *responseJ = json_object_new_array();
+
+  ModbusRtuSensorsId(batch->rtu, 2, responseJ);
+  afb_data_t repldata = afb_data_json_c_hold(responseJ);
+  afb_req_reply(batch->request, 0, 1, &repldata);
+}
+
+// read every sensor (sensors of a block share one transaction), then reply
+static int ModbusAdminInfoStart(afb_req_t request, ModbusRtuT *rtu) {
+  ModbusAdminBatchT *batch;
+  ModbusSensorT *sensor;
+  bool online = ModbusBreakerAllows(rtu, false);
+  uint count;
+
+  // blocks are being planned again
+  if (atomic_load_explicit(&rtu->connection->connecting, memory_order_acquire))
+    return -1;
+
+  for (count = 0; rtu->sensors[count].uid; count++);
+  batch = ModbusAdminBatchCreate(request, rtu, count, ModbusAdminInfoReply);
+  if (!batch)
+    return -1;
+
+  for (uint idx = 0; idx < count; idx++) {
+    sensor = &rtu->sensors[idx];
+    batch->xfers[idx].class = MB_CLASS_READ;
+    batch->xfers[idx].context = sensor;
+    // failed reads leave the value found in cache
+    if (!online || !sensor->block || ModbusSensorReadSubmit(sensor, &batch->xfers[idx]))
+      ModbusAdminBatchRelease(batch);
+  }
+  ModbusAdminBatchRelease(batch);
+  return 0;
+}
+
+static void ModbusAdminDisconnectReply(ModbusAdminBatchT *batch) {
+  afb_req_reply(batch->request, 0, 0, NULL);
+}
+
+// every socket of the pool is closed by its own I/O thread
+static int ModbusAdminDisconnectStart(afb_req_t request, ModbusRtuT *rtu) {
+  ModbusAdminBatchT *batch;
+  ModbusConnectionT *link;
+  uint count = 0, idx = 0;
+
+  // a connect running in the background must not undo this one
+  atomic_store(&rtu->connection->abandoned, true);
+  for (link = rtu->connection; link; link = link->next)
+    count++;
+  batch = ModbusAdminBatchCreate(request, rtu, count, ModbusAdminDisconnectReply);
+  if (!batch)
+    return -1;
+
+  for (link = rtu->connection; link; link = link->next, idx++) {
+    batch->xfers[idx].class = MB_CLASS_DIAG;
+    batch->xfers[idx].runCB = ModbusRtuDisconnectRun;
+    batch->xfers[idx].link = link;
+    if (ModbusXferSubmit(rtu->connection, &batch->xfers[idx]))
+      ModbusAdminBatchRelease(batch);
+  }
+  ModbusAdminBatchRelease(batch);
+  return 0;
 }
 
 void ModbusRtuRequest(afb_req_t request, ModbusRtuT *rtu, json_object *queryJ) {
-  modbus_t *ctx = (modbus_t *)rtu->connection->context;
   const char *action;
   const char *uri = NULL;
   int verbose = 0;
@@ -923,7 +2868,7 @@ void ModbusRtuRequest(afb_req_t request, ModbusRtuT *rtu, json_object *queryJ) {
 
   if (!strcasecmp(action, "connect")) {
 
-    if (rtu->connection->context) {
+    if (rtu->connection->context || atomic_load(&rtu->connection->connecting)) {
       afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
           "ModbusRtuAdmin, cannot connect twice rtu=%s query=%s",
           rtu->uid, json_object_get_string(queryJ));
@@ -937,28 +2882,56 @@ void ModbusRtuRequest(afb_req_t request, ModbusRtuT *rtu, json_object *queryJ) {
       goto OnErrorExit;
     }
 
-    rtu->connection->uri = uri;
-    err = ModbusRtuConnect(afb_req_get_api(request), rtu->connection, rtu->uid);
-    if (err) {
-      afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
-          "ModbusRtuAdmin, fail to connect: uri=%s query=%s",
-          uri, json_object_get_string(queryJ));
-      goto OnErrorExit;
-    } else {
-      err = ModbusRtuSetSlave(afb_req_get_api(request), rtu);
-      if (err) {
+    // registered links may be shared by several RTUs, their URI and
+    // registry key come from the config
+    if (rtu->connection->key) {
+      char *key = ModbusNormalizeURI(uri);
+      bool same = key && !strcmp(key, rtu->connection->key);
+      free(key);
+      if (!same) {
+        afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
+            "ModbusRtuAdmin, cannot change the URI of a shared link rtu=%s uri=%s query=%s",
+            rtu->uid, rtu->connection->uri, json_object_get_string(queryJ));
+        goto OnErrorExit;
+      }
+    } else if (!rtu->connection->uri || strcmp(uri, rtu->connection->uri)) {
+      char *copy = strdup(uri);
+      if (!copy) {
         afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
-            "ModbusRtuAdmin, failed to set slave ID uri=%s query=%s",
-            uri, json_object_get_string(queryJ));
+            "ModbusRtuAdmin, out of memory rtu=%s", rtu->uid);
+        goto OnErrorExit;
       }
+      free(rtu->connection->adminuri);
+      rtu->connection->adminuri = copy;
+      rtu->connection->uri = copy;
+    }
+
+    // name resolution and TCP connect may take seconds, the reply is sent
+    // by the connect thread
+    if (ModbusAdminConnectStart(request, rtu)) {
+      afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
+          "ModbusRtuAdmin, fail to start connect: uri=%s query=%s",
+          uri, json_object_get_string(queryJ));
     }
+    return;
 
   } else if (!strcasecmp(action, "disconnect")) {
-    modbus_close(ctx);
-    modbus_free(ctx);
-    rtu->connection->context = NULL;
+    // replied once every socket is closed
+    if (ModbusAdminDisconnectStart(request, rtu)) {
+      afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
+          "ModbusRtuAdmin, fail to start disconnect: rtu=%s", rtu->uid);
+    }
+    return;
 
   } else if (!strcasecmp(action, "info")) {
+    // values are replied once read, without holding the binder thread
+    if (verbose == 2) {
+      if (ModbusAdminInfoStart(request, rtu)) {
+        afb_req_reply_string_f(request, AFB_ERRNO_INTERNAL_ERROR,
+            "ModbusRtuAdmin, fail to start info: rtu=%s", rtu->uid);
+      }
+      return;
+    }
 
     responseJ = json_object_new_array();
     ModbusRtuSensorsId(rtu, verbose, responseJ);
@@ -0,0 +1,375 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+#include <modbus/modbus.h>
+
+// serial framing: 8 bytes request, 5 bytes response header+crc, 2x3.5 chars silence
+#ifndef MB_SERIAL_FRAME_CHARS
+#define MB_SERIAL_FRAME_CHARS 20
+#endif
+
+// estimated slave processing time between request and response
+#ifndef MB_SERIAL_TURNAROUND_US
+#define MB_SERIAL_TURNAROUND_US 5000
+#endif
+
+// TCP round trip used until one is measured at connect time
+#ifndef MB_TCP_DEFAULT_RTT_US
+#define MB_TCP_DEFAULT_RTT_US 2000
+#endif
+
+// transfer time of one byte on a 100Mbit/s link
+#define MB_TCP_BYTE_US 0.08
+
+// number of registers (or coils) covered by a sensor on the device
+uint ModbusSensorSpan(ModbusSensorT *sensor) {
+  switch (sensor->function->type) {
+  case MB_COIL_STATUS:
+  case MB_COIL_INPUT:
+    return sensor->count;
+  default:
+    return sensor->count * sensor->format->nbreg;
+  }
+}
+
+// bytes of a sensor view, coils take one byte each
+uint ModbusSensorBytes(ModbusSensorT *sensor) {
+  switch (sensor->function->type) {
+  case MB_COIL_STATUS:
+  case MB_COIL_INPUT:
+    return sensor->count;
+  default:
+    return sensor->count * sensor->format->nbreg * sizeof(uint16_t);
+  }
+}
+
+// largest span a single read request may cover for a given register type
+static uint PlannerMaxSpan(ModbusFunctionCbT *function) {
+  switch (function->type) {
+  case MB_COIL_STATUS:
+  case MB_COIL_INPUT:
+    return MODBUS_MAX_READ_BITS;
+  default:
+    return MODBUS_MAX_READ_REGISTERS;
+  }
+}
+
+// bytes needed to transfer 'count' registers (or coils) of a given type
+static double PlannerPayloadBytes(ModbusFunctionCbT *function, uint count) {
+  switch (function->type) {
+  case MB_COIL_STATUS:
+  case MB_COIL_INPUT:
+    return count / 8.0;
+  default:
+    return count * 2.0;
+  }
+}
+
+/**
+ * Check if bridging a hole of 'gap' registers is cheaper than a new request
+ *
+ * On serial links the fixed cost of a transaction (framing, silences, slave
+ * turnaround) is compared with the time needed to transfer the useless
+ * registers at the link baud rate. On TCP the fixed cost is the round trip
+ * measured at connect time.
+ */
+static bool PlannerGapIsCheaper(ModbusRtuT *rtu, ModbusFunctionCbT *function, uint gap) {
+  ModbusConnectionT *connection = rtu->connection;
+  double bytes = PlannerPayloadBytes(function, gap);
+  double frame, transfer, chartime;
+  int baud = ModbusConnectionBaud(connection);
+
+  if (rtu->maxgap >= 0 && gap > (uint)rtu->maxgap)
+    return false;
+
+  if (baud > 0) {
+    // 8N1: start + 8 data + stop bits per char
+    chartime = 10 * 1000000.0 / baud;
+    frame = MB_SERIAL_FRAME_CHARS * chartime + MB_SERIAL_TURNAROUND_US;
+    transfer = bytes * chartime;
+  } else {
+    frame = connection->rtt ? connection->rtt : MB_TCP_DEFAULT_RTT_US;
+    transfer = bytes * MB_TCP_BYTE_US;
+  }
+
+  return transfer < frame;
+}
+
+// expected duration of one read transaction of 'count' registers (or coils)
+static double PlannerFrameUs(ModbusRtuT *rtu, ModbusFunctionCbT *function, uint count) {
+  ModbusConnectionT *connection = rtu->connection;
+  double bytes = PlannerPayloadBytes(function, count);
+  double chartime;
+  int baud = ModbusConnectionBaud(connection);
+
+  if (baud > 0) {
+    chartime = 10 * 1000000.0 / baud;
+    return (MB_SERIAL_FRAME_CHARS + bytes) * chartime + MB_SERIAL_TURNAROUND_US;
+  }
+  return (connection->rtt ? connection->rtt : MB_TCP_DEFAULT_RTT_US) +
+         bytes * MB_TCP_BYTE_US;
+}
+
+// expected bus time (us) needed to refresh a whole block, one frame per chunk
+uint ModbusBlockCostUs(ModbusRtuT *rtu, ModbusBlockT *block) {
+  double cost = 0;
+
+  for (uint idx = 0; idx < block->nchunks; idx++)
+    cost += PlannerFrameUs(rtu, block->function, block->chunks[idx].count);
+
+  return (uint)cost;
+}
+
+// check if [start, end[ intersects one of the RTU no-read ranges
+static bool PlannerIsNoRead(ModbusRtuT *rtu, ModbusFunctionCbT *function, uint start, uint end) {
+  ModbusRangeT *range;
+
+  if (!rtu->noread)
+    return false;
+
+  for (range = rtu->noread; range->count; range++) {
+    if (range->function && range->function->type != function->type)
+      continue;
+    if (start < range->registry + range->count && range->registry < end)
+      return true;
+  }
+  return false;
+}
+
+// sort sensors by register type then by address
+static int PlannerSensorCompare(const void *a, const void *b) {
+  const ModbusSensorT *sa = *(ModbusSensorT *const *)a;
+  const ModbusSensorT *sb = *(ModbusSensorT *const *)b;
+
+  if (sa->function->type != sb->function->type)
+    return (int)sa->function->type - (int)sb->function->type;
+
+  return (sa->registry > sb->registry) - (sa->registry < sb->registry);
+}
+
+/**
+ * Lay the blocks of an RTU out in its shadow images
+ *
+ * Each register type gets one allocation holding the raw image, where
+ * blocks are placed back to back in address order, then the current and
+ * previous values of every member sensor. Sensors own their value slots:
+ * overlapping sensors keep their last good value apart, so a failed
+ * member never sees it overwritten by the read of a neighbour.
+ *
+ * @return 0 = OK, -1 when out of memory
+ */
+static int PlannerLayout(ModbusRtuT *rtu, int nblocks) {
+  ModbusImageT *image;
+  ModbusBlockT *block;
+  ModbusSensorT *sensor;
+  uint16_t *base;
+  uint values[MB_IMAGE_SLOTS] = {0};
+  uint slot;
+
+  for (int idx = 0; idx < nblocks; idx++) {
+    block = &rtu->blocks[idx];
+    slot = block->function->type;
+    image = &rtu->images[slot];
+    block->offset = image->size;
+    // coils are byte sized, one word per coil is more than enough
+    image->size += block->count;
+    for (uint jdx = 0; jdx < block->nsensors; jdx++)
+      image->values += (ModbusSensorBytes(block->sensors[jdx]) + 1) / 2;
+  }
+
+  for (slot = 0; slot < MB_IMAGE_SLOTS; slot++) {
+    image = &rtu->images[slot];
+    if (!image->size)
+      continue;
+    base = (uint16_t *)calloc(image->size + 2 * image->values, sizeof(uint16_t));
+    if (!base)
+      return -1;
+    image->raw = base;
+    image->current = base + image->size;
+    image->previous = base + image->size + image->values;
+  }
+
+  for (int idx = 0; idx < nblocks; idx++) {
+    block = &rtu->blocks[idx];
+    slot = block->function->type;
+    image = &rtu->images[slot];
+    block->buffer = image->raw + block->offset;
+    for (uint jdx = 0; jdx < block->nsensors; jdx++) {
+      sensor = block->sensors[jdx];
+      sensor->buffer = image->current + values[slot];
+      sensor->previous = image->previous + values[slot];
+      values[slot] += (ModbusSensorBytes(sensor) + 1) / 2;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Build the read plan of an RTU
+ *
+ * Readable sensors of the same register type whose addresses are contiguous
+ * (or overlapping) are grouped into blocks fetched with one modbus request,
+ * within the 125 registers / 2000 coils protocol limits. Holes between
+ * sensors are bridged when the link cost model says one larger request is
+ * cheaper than two, unless the RTU max_gap or no_read_ranges forbid it.
+ * Every sensor is attached to exactly one block, isolated sensors get a
+ * block of their own.
+ *
+ * @param api AFB API for logging purposes
+ * @param rtu RTU whose sensors are already loaded
+ * @return error code, 0 = OK, <0 = KO
+ */
+int ModbusRtuPlanBlocks(afb_api_t api, ModbusRtuT *rtu) {
+  ModbusSensorT **sorted = NULL;
+  ModbusSensorT *sensor;
+  ModbusBlockT *block = NULL;
+  int count, readable = 0, nblocks = 0;
+  uint start, end, blockend;
+
+  for (count = 0; rtu->sensors[count].uid; count++);
+
+  sorted = (ModbusSensorT **)calloc(count + 1, sizeof(ModbusSensorT *));
+  if (!sorted)
+    goto OnMemoryError;
+
+  // write only sensors never touch the read plan
+  for (int idx = 0; idx < count; idx++) {
+    if (rtu->sensors[idx].function->readCB)
+      sorted[readable++] = &rtu->sensors[idx];
+  }
+  qsort(sorted, readable, sizeof(ModbusSensorT *), PlannerSensorCompare);
+
+  // worst case is one block per sensor
+  rtu->blocks = (ModbusBlockT *)calloc(readable + 1, sizeof(ModbusBlockT));
+  if (!rtu->blocks)
+    goto OnMemoryError;
+
+  for (int idx = 0; idx < readable; idx++) {
+    sensor = sorted[idx];
+    start = sensor->registry;
+    end = start + ModbusSensorSpan(sensor);
+
+    if (block && block->function->type == sensor->function->type) {
+      blockend = block->registry + block->count;
+      if ((end > blockend ? end : blockend) - block->registry <=
+              PlannerMaxSpan(block->function) &&
+          (start <= blockend ||
+           (PlannerGapIsCheaper(rtu, block->function, start - blockend) &&
+            !PlannerIsNoRead(rtu, block->function, blockend, start)))) {
+        if (end > blockend)
+          block->count = end - block->registry;
+        sensor->block = block;
+        block->nsensors++;
+        continue;
+      }
+    }
+
+    // open a new block starting with this sensor
+    block = &rtu->blocks[nblocks++];
+    block->function = sensor->function;
+    block->registry = start;
+    block->count = end - start;
+    block->nsensors = 1;
+    sensor->block = block;
+  }
+
+  // sorted order keeps members of a block next to each other
+  for (int idx = 0; idx < nblocks; idx++) {
+    block = &rtu->blocks[idx];
+    block->sensors =
+        (ModbusSensorT **)calloc(block->nsensors + 1, sizeof(ModbusSensorT *));
+    if (!block->sensors)
+      goto OnMemoryError;
+    block->nsensors = 0;
+    pthread_mutex_init(&block->mutex, NULL);
+    pthread_mutex_init(&block->cache, NULL);
+
+    // whole block is first read at once, the split map is refined on
+    // device exceptions
+    block->chunks = (ModbusRangeT *)calloc(1, sizeof(ModbusRangeT));
+    if (!block->chunks)
+      goto OnMemoryError;
+    block->chunks[0].function = block->function;
+    block->chunks[0].registry = block->registry;
+    block->chunks[0].count = block->count;
+    block->nchunks = 1;
+  }
+
+  for (int idx = 0; idx < readable; idx++) {
+    sensor = sorted[idx];
+    block = sensor->block;
+    block->sensors[block->nsensors++] = sensor;
+  }
+
+  // block and sensor buffers are slots of the RTU shadow images
+  if (PlannerLayout(rtu, nblocks))
+    goto OnMemoryError;
+
+  AFB_API_NOTICE(api, "ModbusRtuPlanBlocks: rtu=%s %d readable sensors in %d block(s)",
+                 rtu->uid, readable, nblocks);
+  free(sorted);
+  return 0;
+
+OnMemoryError:
+  AFB_API_ERROR(api, "ModbusRtuPlanBlocks: out of memory rtu=%s", rtu->uid);
+  free(sorted);
+  return -1;
+}
+
+// release the read plan of an RTU, no read may be in flight
+static void PlannerFree(ModbusRtuT *rtu) {
+  ModbusBlockT *block;
+
+  for (block = rtu->blocks; block && block->function; block++) {
+    pthread_mutex_destroy(&block->mutex);
+    pthread_mutex_destroy(&block->cache);
+    free(block->sensors);
+    free(block->chunks);
+  }
+  free(rtu->blocks);
+  rtu->blocks = NULL;
+
+  for (uint slot = 0; slot < MB_IMAGE_SLOTS; slot++)
+    free(rtu->images[slot].raw);
+  memset(rtu->images, 0, sizeof(rtu->images));
+}
+
+/**
+ * Plan the blocks of an RTU again once its TCP link measured a round trip
+ *
+ * The first plan is built at config time, before any link is connected,
+ * with the default round trip. Must be called before the RTU accepts
+ * requests: sensors must not be subscribed nor read meanwhile.
+ *
+ * @return error code, 0 = OK, <0 = KO
+ */
+int ModbusRtuReplanBlocks(afb_api_t api, ModbusRtuT *rtu) {
+  if (!rtu->connection->rtt)
+    return 0;
+
+  PlannerFree(rtu);
+  return ModbusRtuPlanBlocks(api, rtu);
+}
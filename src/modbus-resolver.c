@@ -0,0 +1,312 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Gateway host names are resolved with getaddrinfo (IPv4 and IPv6) and the
+// result is cached per host:port, so a reconnect storm does not hammer the
+// resolver. Lookups only run on connect threads and I/O threads, never on
+// the afb event loop. Connects race the resolved addresses "happy eyeballs"
+// style: a new attempt starts every MB_CONNECT_STAGGER_MS until one
+// succeeds.
+
+// lifetime of a successful resolution
+#ifndef MB_RESOLVE_TTL_MS
+#define MB_RESOLVE_TTL_MS 60000
+#endif
+
+// lifetime of a failed resolution, avoids retrying a dead resolver on
+// every reconnect attempt
+#ifndef MB_RESOLVE_NEGATIVE_TTL_MS
+#define MB_RESOLVE_NEGATIVE_TTL_MS 5000
+#endif
+
+// addresses kept per host
+#ifndef MB_RESOLVE_MAX_ADDRS
+#define MB_RESOLVE_MAX_ADDRS 8
+#endif
+
+// delay before the next address is tried while previous attempts are pending
+#ifndef MB_CONNECT_STAGGER_MS
+#define MB_CONNECT_STAGGER_MS 250
+#endif
+
+// overall TCP connect timeout, all addresses included
+#ifndef MB_CONNECT_TIMEOUT_MS
+#define MB_CONNECT_TIMEOUT_MS 5000
+#endif
+
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t len;
+} ResolverAddrT;
+
+typedef struct ResolverEntryS {
+  char *host;
+  int port;
+  ResolverAddrT addrs[MB_RESOLVE_MAX_ADDRS];
+  uint count;            // 0 when the last lookup failed without stale data
+  int error;             // getaddrinfo error of the last failed lookup
+  uint64_t expire;       // monotonic time (ms)
+  bool resolving;        // one thread runs getaddrinfo, others wait
+  struct ResolverEntryS *next;
+} ResolverEntryT;
+
+static pthread_mutex_t ResolverMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ResolverCond = PTHREAD_COND_INITIALIZER;
+static ResolverEntryT *ResolverCache;
+
+// alternate address families, first one as returned by the resolver (RFC 8305)
+static uint ResolverInterleave(struct addrinfo *result, ResolverAddrT *addrs) {
+  struct addrinfo *family[2] = {result, NULL}, *ai;
+  uint count = 0, turn = 0;
+
+  for (ai = result; ai; ai = ai->ai_next) {
+    if (ai->ai_family != result->ai_family) {
+      family[1] = ai;
+      break;
+    }
+  }
+
+  while (count < MB_RESOLVE_MAX_ADDRS && (family[0] || family[1])) {
+    ai = family[turn];
+    if (ai) {
+      memcpy(&addrs[count].addr, ai->ai_addr, ai->ai_addrlen);
+      addrs[count].len = ai->ai_addrlen;
+      count++;
+      // next address of the same family
+      for (ai = ai->ai_next; ai && ai->ai_family != family[turn]->ai_family; ai = ai->ai_next);
+      family[turn] = ai;
+    }
+    turn = !turn;
+  }
+  return count;
+}
+
+// lookup and store in the entry, ResolverMutex released meanwhile
+static void ResolverRefresh(afb_api_t api, ResolverEntryT *entry) {
+  struct addrinfo hints, *result = NULL;
+  ResolverAddrT addrs[MB_RESOLVE_MAX_ADDRS];
+  char service[16];
+  uint count = 0;
+  int err;
+
+  entry->resolving = true;
+  pthread_mutex_unlock(&ResolverMutex);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_ADDRCONFIG;
+  snprintf(service, sizeof(service), "%d", entry->port);
+  err = getaddrinfo(entry->host, service, &hints, &result);
+  if (!err) {
+    count = ResolverInterleave(result, addrs);
+    freeaddrinfo(result);
+  }
+
+  pthread_mutex_lock(&ResolverMutex);
+  entry->resolving = false;
+  pthread_cond_broadcast(&ResolverCond);
+
+  if (count) {
+    memcpy(entry->addrs, addrs, count * sizeof(ResolverAddrT));
+    entry->count = count;
+    entry->error = 0;
+    entry->expire = ModbusNowMs() + MB_RESOLVE_TTL_MS;
+    return;
+  }
+
+  // a resolver hiccup keeps the previous addresses until the next retry
+  entry->error = err ? err : EAI_NONAME;
+  entry->expire = ModbusNowMs() + MB_RESOLVE_NEGATIVE_TTL_MS;
+  AFB_API_WARNING(api, "ModbusResolve: host=%s error=%s%s", entry->host,
+                  gai_strerror(entry->error),
+                  entry->count ? ", using previous addresses" : "");
+}
+
+/**
+ * Resolve a gateway host through the cache
+ *
+ * Concurrent lookups of the same host wait for a single getaddrinfo call.
+ * May block up to the system resolver timeout, do not call it from the
+ * event loop.
+ *
+ * @param addrs receives up to MB_RESOLVE_MAX_ADDRS addresses, in connect order
+ * @return number of addresses, 0 when the host does not resolve
+ */
+static uint ModbusResolve(afb_api_t api, const char *host, int port, ResolverAddrT *addrs) {
+  ResolverEntryT *entry;
+  uint count;
+
+  pthread_mutex_lock(&ResolverMutex);
+  for (entry = ResolverCache; entry; entry = entry->next) {
+    if (entry->port == port && !strcasecmp(entry->host, host))
+      break;
+  }
+
+  if (!entry) {
+    entry = (ResolverEntryT *)calloc(1, sizeof(ResolverEntryT));
+    if (!entry || !(entry->host = strdup(host))) {
+      pthread_mutex_unlock(&ResolverMutex);
+      AFB_API_ERROR(api, "ModbusResolve: out of memory");
+      free(entry);
+      return 0;
+    }
+    entry->port = port;
+    entry->next = ResolverCache;
+    ResolverCache = entry;
+  }
+
+  while (entry->resolving)
+    pthread_cond_wait(&ResolverCond, &ResolverMutex);
+  if (ModbusNowMs() >= entry->expire)
+    ResolverRefresh(api, entry);
+
+  count = entry->count;
+  memcpy(addrs, entry->addrs, count * sizeof(ResolverAddrT));
+  pthread_mutex_unlock(&ResolverMutex);
+  return count;
+}
+
+// start a non blocking connect, returns the socket or -1
+static int ConnectStart(ResolverAddrT *addr) {
+  int fd;
+
+  fd = socket(addr->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  if (fd < 0)
+    return -1;
+  if (connect(fd, (struct sockaddr *)&addr->addr, addr->len) < 0 && errno != EINPROGRESS) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Open a TCP connection to a gateway
+ *
+ * Resolved addresses are tried in turn, a new attempt starting every
+ * MB_CONNECT_STAGGER_MS while the previous ones are still pending, or at
+ * once when one fails. The first established connection wins and the
+ * other attempts are dropped.
+ *
+ * @param api AFB API for logging purposes
+ * @param host gateway name or numeric IPv4/IPv6 address
+ * @param port gateway TCP port
+ * @param rtt when not NULL, receives the handshake duration (us)
+ * @return connected blocking socket with TCP_NODELAY, -1 with errno set
+ */
+int ModbusTcpConnect(afb_api_t api, const char *host, int port, uint *rtt) {
+  ResolverAddrT addrs[MB_RESOLVE_MAX_ADDRS];
+  struct pollfd fds[MB_RESOLVE_MAX_ADDRS];
+  uint64_t started[MB_RESOLVE_MAX_ADDRS];
+  uint64_t now, nextat, deadline;
+  uint count, next = 0, npending = 0;
+  int fd = -1, err = ECONNREFUSED, sockerr, flag = 1, wait;
+  socklen_t len;
+
+  count = ModbusResolve(api, host, port, addrs);
+  if (!count) {
+    errno = EHOSTUNREACH;
+    return -1;
+  }
+
+  now = ModbusNowMs();
+  nextat = now;
+  deadline = now + MB_CONNECT_TIMEOUT_MS;
+
+  while (fd < 0) {
+    if (next < count && now >= nextat) {
+      fds[npending].fd = ConnectStart(&addrs[next++]);
+      if (fds[npending].fd < 0) {
+        err = errno;
+        continue;
+      }
+      fds[npending].events = POLLOUT;
+      started[npending++] = ModbusNowUs();
+      nextat = now + MB_CONNECT_STAGGER_MS;
+    }
+    if (!npending) {
+      if (next < count)
+        continue;
+      break;
+    }
+    if (now >= deadline) {
+      err = ETIMEDOUT;
+      break;
+    }
+
+    wait = (int)(((next < count && nextat < deadline) ? nextat : deadline) - now);
+    if (wait < 0)
+      wait = 0;
+    if (poll(fds, npending, wait) < 0 && errno != EINTR) {
+      err = errno;
+      break;
+    }
+
+    for (uint idx = 0; idx < npending && fd < 0;) {
+      if (!fds[idx].revents) {
+        idx++;
+        continue;
+      }
+      len = sizeof(sockerr);
+      if (getsockopt(fds[idx].fd, SOL_SOCKET, SO_ERROR, &sockerr, &len) < 0)
+        sockerr = errno;
+      if (!sockerr) {
+        fd = fds[idx].fd;
+        if (rtt)
+          *rtt = (uint)(ModbusNowUs() - started[idx]);
+      } else {
+        // failed attempt, the next address does not wait its turn
+        err = sockerr;
+        close(fds[idx].fd);
+        nextat = 0;
+      }
+      fds[idx] = fds[--npending];
+      started[idx] = started[npending];
+    }
+    now = ModbusNowMs();
+  }
+
+  for (uint idx = 0; idx < npending; idx++)
+    close(fds[idx].fd);
+  if (fd < 0) {
+    errno = err;
+    return -1;
+  }
+
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  return fd;
+}
@@ -0,0 +1,448 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+
+// A connection owns one scheduler holding every subscribed sensor of every
+// RTU on the link. Only one afb job per scheduler is posted at a time, for
+// the earliest deadline; it hands all due polls to the connection I/O
+// thread then posts the next one. A poll is requeued once its read has
+// completed. A poll which could not run in time is not queued again: its
+// missed periods are counted and reported, and it resumes on its period.
+
+// Polls are spread over their period: each new poll gets the phase in the
+// middle of the largest idle time left by the polls already scheduled, so
+// sensors sharing the same period do not hit the link in one burst.
+
+// libmodbus response timeout when the RTU does not set one
+#ifndef SCHEDULER_DEFAULT_TIMEOUT_MS
+#define SCHEDULER_DEFAULT_TIMEOUT_MS 500
+#endif
+
+// bus time reserved by one poll within the period
+typedef struct {
+  uint start;
+  uint length;
+} SchedulerWindowT;
+
+// identifies the wakeup job currently posted, older jobs become no-op
+typedef struct {
+  ModbusSchedulerT *scheduler;
+} SchedulerWakeupT;
+
+static void SchedulerRun(int signum, void *arg);
+
+// protects lazy scheduler creation on shared connections
+static pthread_mutex_t SchedulerCreateMutex = PTHREAD_MUTEX_INITIALIZER;
+
+// insert a poll in deadline order, must be called with mutex held
+static void SchedulerInsert(ModbusSchedulerT *scheduler, ModbusEvtT *poll) {
+  ModbusEvtT **prev;
+
+  for (prev = &scheduler->polls; *prev; prev = &(*prev)->next) {
+    if ((*prev)->deadline > poll->deadline)
+      break;
+  }
+  poll->next = *prev;
+  *prev = poll;
+}
+
+static int SchedulerWindowCompare(const void *a, const void *b) {
+  const SchedulerWindowT *wa = (const SchedulerWindowT *)a;
+  const SchedulerWindowT *wb = (const SchedulerWindowT *)b;
+  return (wa->start > wb->start) - (wa->start < wb->start);
+}
+
+static uint SchedulerSlotMs(ModbusEvtT *poll) {
+  uint slot = (poll->slot + 999) / 1000;
+  return slot ? slot : 1;
+}
+
+// time a silent device holds the link: learned response timeout when
+// there is one, configured timeout otherwise
+static uint SchedulerTimeoutMs(ModbusEvtT *poll) {
+  ModbusRtuT *rtu = poll->sensor->rtu;
+  uint timeout = 0;
+
+  if (rtu->autotimeout) {
+    pthread_mutex_lock(&rtu->mutex);
+    timeout = rtu->latency[poll->sensor->function->type].timeout;
+    pthread_mutex_unlock(&rtu->mutex);
+  }
+  if (!timeout)
+    timeout = rtu->timeout ? (uint)rtu->timeout : SCHEDULER_DEFAULT_TIMEOUT_MS;
+  return timeout;
+}
+
+/**
+ * Choose the phase of a new poll within its period
+ *
+ * Every scheduled poll is projected on the new poll period as a window as
+ * long as its expected transaction time. The new poll reserves its own
+ * transaction time plus its response timeout, so a silent device does not
+ * delay the next window, and is centered in the largest gap between
+ * windows. Polls of a block already scheduled with the same period share
+ * its phase, the block is then read only once.
+ * Must be called with mutex held.
+ */
+static void SchedulerPhase(ModbusSchedulerT *scheduler, ModbusEvtT *poll) {
+  SchedulerWindowT *windows = NULL, *tmp;
+  uint nwindows = 0, maxwindows = 0;
+  uint period = poll->period, slot = SchedulerSlotMs(poll);
+  uint gapstart = 0, gaplen = 0, start, end, len, timeout, reserve;
+  ModbusRtuT *rtu = poll->sensor->rtu;
+  ModbusEvtT *other;
+
+  // polls in flight keep their place in the period
+  poll->phase = 0;
+  for (other = scheduler->scheduled; other; other = other->sibling) {
+    if (other == poll)
+      continue;
+    if (other->sensor->block == poll->sensor->block && other->period == period) {
+      poll->phase = other->phase;
+      return;
+    }
+
+    // faster polls appear several times within the period
+    for (uint64_t at = other->phase; at < period || at == other->phase; at += other->period) {
+      if (nwindows == maxwindows) {
+        maxwindows = maxwindows ? 2 * maxwindows : 16;
+        tmp = (SchedulerWindowT *)realloc(windows, maxwindows * sizeof(SchedulerWindowT));
+        if (!tmp) {
+          AFB_API_ERROR(scheduler->api, "SchedulerPhase: out of memory");
+          free(windows);
+          return;
+        }
+        windows = tmp;
+      }
+      windows[nwindows].start = (uint)(at % period);
+      windows[nwindows].length = SchedulerSlotMs(other);
+      nwindows++;
+      if (other->period >= period)
+        break;
+    }
+  }
+
+  // first poll of the link
+  if (!nwindows)
+    return;
+
+  qsort(windows, nwindows, sizeof(SchedulerWindowT), SchedulerWindowCompare);
+  for (uint idx = 0; idx < nwindows; idx++) {
+    end = windows[idx].start + windows[idx].length;
+    if (idx + 1 < nwindows)
+      start = windows[idx + 1].start;
+    else
+      start = windows[0].start + period;
+    len = start > end ? start - end : 0;
+    if (len > gaplen) {
+      gaplen = len;
+      gapstart = end;
+    }
+  }
+  free(windows);
+
+  // a silent device holds the link for the whole response timeout
+  timeout = SchedulerTimeoutMs(poll);
+  reserve = slot + timeout;
+  if (gaplen >= reserve) {
+    poll->phase = (gapstart + (gaplen - reserve) / 2) % period;
+    return;
+  }
+
+  // no room for a timeout, start early so it eats as little as possible
+  // of the following window
+  poll->phase = gapstart % period;
+  AFB_API_NOTICE(scheduler->api,
+                 "SchedulerPhase: rtu=%s sensor=%s idle time=%dms shorter than slot+timeout=%dms, "
+                 "a device timeout will delay following polls",
+                 rtu->uid, poll->sensor->uid, gaplen, reserve);
+}
+
+// set poll phase and next deadline then insert, must be called with mutex held
+static void SchedulerPlace(ModbusSchedulerT *scheduler, ModbusEvtT *poll) {
+  uint64_t elapsed, next;
+
+  SchedulerPhase(scheduler, poll);
+  elapsed = ModbusNowMs() - scheduler->epoch;
+  next = elapsed - elapsed % poll->period + poll->phase;
+  if (next <= elapsed)
+    next += poll->period;
+  poll->deadline = scheduler->epoch + next;
+  poll->replace = false;
+  poll->placed = poll->period;
+  SchedulerInsert(scheduler, poll);
+}
+
+// post a job for the earliest deadline, must be called with mutex held
+static void SchedulerArm(ModbusSchedulerT *scheduler) {
+  SchedulerWakeupT *wakeup;
+  uint64_t deadline, now;
+  int jobid;
+
+  if (!scheduler->polls)
+    return;
+
+  // a wakeup already posted early enough will handle it
+  deadline = scheduler->polls->deadline;
+  if (scheduler->pending && scheduler->wakeup <= deadline)
+    return;
+
+  wakeup = (SchedulerWakeupT *)calloc(1, sizeof(SchedulerWakeupT));
+  if (!wakeup) {
+    AFB_API_ERROR(scheduler->api, "SchedulerArm: out of memory");
+    return;
+  }
+  wakeup->scheduler = scheduler;
+
+  now = ModbusNowMs();
+  jobid = afb_job_post(deadline > now ? (long)(deadline - now) : 0, 0,
+                       SchedulerRun, wakeup, scheduler);
+  if (jobid < 0) {
+    AFB_API_ERROR(scheduler->api, "SchedulerArm: fail to post job uri=%s",
+                  scheduler->connection->uri);
+    free(wakeup);
+    return;
+  }
+
+  // any previously posted job is now stale
+  scheduler->pending = wakeup;
+  scheduler->wakeup = deadline;
+}
+
+static void SchedulerRun(int signum, void *arg) {
+  SchedulerWakeupT *wakeup = (SchedulerWakeupT *)arg;
+  ModbusSchedulerT *scheduler = wakeup->scheduler;
+  ModbusEvtT *poll, *due = NULL, **tail = &due;
+  uint64_t now, late;
+  uint missed;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  if (scheduler->pending != wakeup) {
+    pthread_mutex_unlock(&scheduler->mutex);
+    free(wakeup);
+    return;
+  }
+  scheduler->pending = NULL;
+
+  if (signum) {
+    AFB_API_ERROR(scheduler->api, "SchedulerRun: interrupted by signal=%d uri=%s",
+                  signum, scheduler->connection->uri);
+  }
+
+  // detach due polls, they run without the lock so subscriptions are
+  // never blocked by bus transactions
+  now = ModbusNowMs();
+  while (scheduler->polls && scheduler->polls->deadline <= now) {
+    poll = scheduler->polls;
+    scheduler->polls = poll->next;
+    poll->next = NULL;
+    *tail = poll;
+    tail = &poll->next;
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  while (due) {
+    poll = due;
+    due = poll->next;
+
+    // report periods which went by while the link was busy
+    late = ModbusNowMs() - poll->deadline;
+    if (late >= poll->period) {
+      missed = (uint)(late / poll->period);
+      poll->missed += missed;
+      poll->deadline += (uint64_t)missed * poll->period;
+      AFB_API_WARNING(scheduler->api,
+                      "SchedulerRun: rtu=%s sensor=%s missed %d deadline(s) period=%dms",
+                      poll->sensor->rtu->uid, poll->sensor->uid, missed, poll->period);
+      pthread_mutex_lock(&scheduler->mutex);
+      scheduler->missed += missed;
+      pthread_mutex_unlock(&scheduler->mutex);
+    }
+    poll->deadline += poll->period;
+
+    // completion requeues the poll, unless it has no more subscriber
+    ModbusSensorPoll(poll);
+  }
+
+  pthread_mutex_lock(&scheduler->mutex);
+  SchedulerArm(scheduler);
+  pthread_mutex_unlock(&scheduler->mutex);
+  free(wakeup);
+}
+
+/**
+ * Add a subscribed sensor to the connection polling scheduler
+ *
+ * The scheduler is created on first use. The first poll happens on the next
+ * occurrence of the poll phase, the subscription itself already read the
+ * sensor.
+ *
+ * @param api AFB API for logging purposes
+ * @param connection link the sensor RTU is attached to
+ * @param poll subscription context, owned by the scheduler until the sensor
+ *             has no more subscriber
+ * @return error code, 0 = OK, <0 = KO
+ */
+int ModbusSchedulerAdd(afb_api_t api, ModbusConnectionT *connection, ModbusEvtT *poll) {
+  ModbusSchedulerT *scheduler;
+
+  pthread_mutex_lock(&SchedulerCreateMutex);
+  scheduler = connection->scheduler;
+  if (!scheduler) {
+    scheduler = (ModbusSchedulerT *)calloc(1, sizeof(ModbusSchedulerT));
+    if (!scheduler) {
+      pthread_mutex_unlock(&SchedulerCreateMutex);
+      AFB_API_ERROR(api, "ModbusSchedulerAdd: out of memory");
+      goto OnErrorExit;
+    }
+    scheduler->api = api;
+    scheduler->connection = connection;
+    scheduler->epoch = ModbusNowMs();
+    pthread_mutex_init(&scheduler->mutex, NULL);
+    connection->scheduler = scheduler;
+  }
+  pthread_mutex_unlock(&SchedulerCreateMutex);
+
+  poll->slot = ModbusBlockCostUs(poll->sensor->rtu, poll->sensor->block);
+  poll->next = NULL;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  poll->sibling = scheduler->scheduled;
+  scheduler->scheduled = poll;
+  SchedulerPlace(scheduler, poll);
+  SchedulerArm(scheduler);
+  pthread_mutex_unlock(&scheduler->mutex);
+  return 0;
+
+OnErrorExit:
+  return -1;
+}
+
+/**
+ * Put back a poll in the scheduler once its read has completed
+ *
+ * @param connection link the sensor RTU is attached to
+ * @param poll subscription context handed by SchedulerRun
+ */
+void ModbusSchedulerRequeue(ModbusConnectionT *connection, ModbusEvtT *poll) {
+  ModbusSchedulerT *scheduler = connection->scheduler;
+
+  // subscriptions changed the polling period
+  pthread_mutex_lock(&scheduler->mutex);
+  if (poll->replace || poll->period != poll->placed)
+    SchedulerPlace(scheduler, poll);
+  else
+    SchedulerInsert(scheduler, poll);
+  SchedulerArm(scheduler);
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+/**
+ * Reschedule a poll after its period changed
+ *
+ * A poll waiting in the scheduler is placed again right away, an in
+ * flight one is placed again when requeued.
+ *
+ * @param connection link the sensor RTU is attached to
+ * @param poll subscription context already added to the scheduler
+ */
+void ModbusSchedulerUpdate(ModbusConnectionT *connection, ModbusEvtT *poll) {
+  ModbusSchedulerT *scheduler = connection->scheduler;
+  ModbusEvtT **prev;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  for (prev = &scheduler->polls; *prev; prev = &(*prev)->next) {
+    if (*prev == poll)
+      break;
+  }
+  if (*prev) {
+    *prev = poll->next;
+    SchedulerPlace(scheduler, poll);
+    SchedulerArm(scheduler);
+  } else {
+    poll->replace = true;
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+/**
+ * Forget a poll whose sensor has no more subscriber
+ *
+ * Called once its last read completed, the poll is not queued anymore.
+ *
+ * @param connection link the sensor RTU is attached to
+ * @param poll subscription context about to be released
+ */
+void ModbusSchedulerRemove(ModbusConnectionT *connection, ModbusEvtT *poll) {
+  ModbusSchedulerT *scheduler = connection->scheduler;
+  ModbusEvtT **prev;
+
+  pthread_mutex_lock(&scheduler->mutex);
+  for (prev = &scheduler->scheduled; *prev; prev = &(*prev)->sibling) {
+    if (*prev == poll) {
+      *prev = poll->sibling;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&scheduler->mutex);
+}
+
+/**
+ * Describe the polling schedule of one RTU for the info verb
+ *
+ * @param connection link the RTU is attached to
+ * @param rtu only polls of this RTU are listed, load covers the whole link
+ * @return {"load", "missed", "polls"} or NULL when nothing is subscribed
+ */
+json_object *ModbusSchedulerInfo(ModbusConnectionT *connection, ModbusRtuT *rtu) {
+  ModbusSchedulerT *scheduler = connection->scheduler;
+  json_object *scheduleJ, *pollsJ, *pollJ;
+  ModbusEvtT *poll;
+  uint64_t now = ModbusNowMs();
+  double load = 0;
+
+  if (!scheduler)
+    return NULL;
+
+  pollsJ = json_object_new_array();
+  pthread_mutex_lock(&scheduler->mutex);
+  // polls in flight are not queued, but still scheduled
+  for (poll = scheduler->scheduled; poll; poll = poll->sibling) {
+    load += poll->slot / (poll->period * 1000.0);
+    if (poll->sensor->rtu != rtu)
+      continue;
+    rp_jsonc_pack(&pollJ, "{ss si si si si si}", "sensor", poll->sensor->uid,
+                  "period", poll->period, "phase", poll->phase, "slot_us", poll->slot,
+                  "next", (int)(poll->deadline > now ? poll->deadline - now : 0),
+                  "missed", poll->missed);
+    json_object_array_add(pollsJ, pollJ);
+  }
+  rp_jsonc_pack(&scheduleJ, "{sf si so}", "load", load, "missed", scheduler->missed,
+                "polls", pollsJ);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  return scheduleJ;
+}
@@ -0,0 +1,724 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <modbus/modbus.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdatomic.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Gateway mode: a Modbus/TCP slave endpoint answering other masters (SCADA,
+// historians) from the values the binding already polls. Reads (functions
+// 01-04) are served from the RTU shadow images without touching the bus,
+// writes (05, 06, 15, 16) are forwarded on the link I/O thread like verb
+// writes. RTUs are selected by the MBAP unit id.
+
+#define SERVER_MBAP_LENGTH 7
+
+// concurrent client connections
+#ifndef MB_SERVER_MAX_CLIENTS
+#define MB_SERVER_MAX_CLIENTS 16
+#endif
+
+// Modbus exception codes
+#define SERVER_ILLEGAL_FUNCTION 0x01
+#define SERVER_ILLEGAL_ADDRESS 0x02
+#define SERVER_ILLEGAL_VALUE 0x03
+#define SERVER_DEVICE_FAILURE 0x04
+#define SERVER_PATH_UNAVAILABLE 0x0A
+#define SERVER_TARGET_FAILED 0x0B
+
+typedef struct ModbusServerS ModbusServerT;
+
+typedef struct ServerClientS {
+  ModbusServerT *server;
+  pthread_mutex_t mutex;  // socket writes, completions run on other threads
+  int fd;                 // -1 once closed
+  afb_evfd_t evfd;
+  atomic_uint refs;       // socket plus writes in flight
+  uint8_t rx[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+  uint rxlen;
+} ServerClientT;
+
+struct ModbusServerS {
+  afb_api_t api;
+  afb_evfd_t evfd;
+  ModbusRtuT *units[256];  // RTU served under each unit id
+  uint maxage;             // oldest value served (ms), 0 = any
+  uint maxclients;
+  atomic_uint clients;
+};
+
+// a write waiting for its bus transaction
+typedef struct {
+  ModbusXferT xfer;        // first member, completion gets the write back
+  ServerClientT *client;
+  uint8_t header[SERVER_MBAP_LENGTH];
+  uint8_t reply[5];        // function, address, count or value
+  ModbusRawWriteT raw;
+} ServerWriteT;
+
+static void ServerClientUnref(ServerClientT *client) {
+  if (atomic_fetch_sub(&client->refs, 1) != 1)
+    return;
+  atomic_fetch_sub(&client->server->clients, 1);
+  pthread_mutex_destroy(&client->mutex);
+  free(client);
+}
+
+// drop the connection, pending writes complete without replying
+static void ServerClientClose(ServerClientT *client) {
+  pthread_mutex_lock(&client->mutex);
+  if (client->fd < 0) {
+    pthread_mutex_unlock(&client->mutex);
+    return;
+  }
+  client->fd = -1;
+  afb_evfd_unref(client->evfd);
+  client->evfd = NULL;
+  pthread_mutex_unlock(&client->mutex);
+  ServerClientUnref(client);
+}
+
+// false once the connection was dropped, a failed reply closes it
+static bool ServerClientAlive(ServerClientT *client) {
+  bool alive;
+
+  pthread_mutex_lock(&client->mutex);
+  alive = client->fd >= 0;
+  pthread_mutex_unlock(&client->mutex);
+  return alive;
+}
+
+// send one response ADU, the MBAP header of the request is reused
+static void ServerReply(ServerClientT *client, const uint8_t *header, const uint8_t *pdu,
+                        uint len) {
+  uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+  ssize_t sent = -1;
+
+  memcpy(adu, header, SERVER_MBAP_LENGTH);
+  adu[4] = (len + 1) >> 8;
+  adu[5] = (len + 1) & 0xFF;
+  memcpy(&adu[SERVER_MBAP_LENGTH], pdu, len);
+
+  pthread_mutex_lock(&client->mutex);
+  if (client->fd >= 0)
+    sent = send(client->fd, adu, SERVER_MBAP_LENGTH + len, MSG_NOSIGNAL);
+  pthread_mutex_unlock(&client->mutex);
+
+  // responses are small, a client not draining its socket (EAGAIN) or a
+  // broken one is dropped, never left waiting for a lost reply
+  if (sent != SERVER_MBAP_LENGTH + len)
+    ServerClientClose(client);
+}
+
+static void ServerException(ServerClientT *client, const uint8_t *header, uint8_t function,
+                            uint8_t code) {
+  uint8_t pdu[2] = {function | 0x80, code};
+
+  ServerReply(client, header, pdu, sizeof(pdu));
+}
+
+static ModbusTypeE ServerFunctionType(uint8_t function) {
+  switch (function) {
+  case 0x01:
+  case 0x05:
+  case 0x0F:
+    return MB_COIL_STATUS;
+  case 0x02:
+    return MB_COIL_INPUT;
+  case 0x03:
+  case 0x06:
+  case 0x10:
+    return MB_REGISTER_HOLDING;
+  default:
+    return MB_REGISTER_INPUT;
+  }
+}
+
+/**
+ * Copy cached values of [registry, registry+count[ from the RTU image
+ *
+ * Every address must belong to a configured sensor: holes bridged by block
+ * reads are not served. Values never read, stale since a failed read, or
+ * older than the server max_age, are refused and one sensor of each such
+ * block is returned in 'refresh', its block read refreshes the others.
+ *
+ * @param values one element per register or coil
+ * @param refresh room for 'count' sensors, NULL = no refresh wanted
+ * @return 0 = OK, else the Modbus exception code
+ */
+static int ServerCopy(ModbusServerT *server, ModbusRtuT *rtu, ModbusTypeE type,
+                      uint registry, uint count, uint16_t *values,
+                      ModbusSensorT **refresh, uint *nrefresh) {
+  bool coil = type == MB_COIL_STATUS || type == MB_COIL_INPUT;
+  uint8_t *covered = (uint8_t *)alloca(count);
+  uint64_t now = ModbusNowMs();
+  ModbusBlockT *block;
+  ModbusSensorT *sensor;
+  uint start, stop, code = 0;
+  bool outdated;
+
+  memset(covered, 0, count);
+  if (nrefresh)
+    *nrefresh = 0;
+  for (block = rtu->blocks; block && block->function; block++) {
+    if (block->function->type != type || block->registry >= registry + count ||
+        registry >= block->registry + block->count)
+      continue;
+
+    outdated = false;
+    pthread_mutex_lock(&block->cache);
+    for (uint idx = 0; idx < block->nsensors; idx++) {
+      sensor = block->sensors[idx];
+      start = sensor->registry > registry ? sensor->registry : registry;
+      stop = sensor->registry + ModbusSensorSpan(sensor);
+      if (stop > registry + count)
+        stop = registry + count;
+      if (start >= stop)
+        continue;
+      if (sensor->quality != MB_QUALITY_GOOD ||
+          (server->maxage && now - sensor->stamp > server->maxage)) {
+        code = SERVER_TARGET_FAILED;
+        if (refresh && !outdated)
+          refresh[(*nrefresh)++] = sensor;
+        outdated = true;
+        continue;
+      }
+      for (uint addr = start; addr < stop; addr++) {
+        values[addr - registry] =
+            coil ? ((uint8_t *)sensor->buffer)[addr - sensor->registry]
+                 : sensor->buffer[addr - sensor->registry];
+        covered[addr - registry] = 1;
+      }
+    }
+    pthread_mutex_unlock(&block->cache);
+  }
+
+  for (uint idx = 0; idx < count; idx++) {
+    if (!covered[idx])
+      return code ? code : SERVER_ILLEGAL_ADDRESS;
+  }
+  return 0;
+}
+
+// read request waiting for the refresh of its blocks
+typedef struct {
+  ServerClientT *client;
+  ModbusRtuT *rtu;
+  uint8_t header[SERVER_MBAP_LENGTH];
+  uint8_t pdu[5];
+  atomic_uint pending;   // block reads not completed yet
+} ServerPendingT;
+
+typedef struct {
+  ModbusXferT xfer;      // first member, completion gets the refresh back
+  ServerPendingT *pending;
+} ServerRefreshT;
+
+static void ServerRead(ServerClientT *client, ModbusRtuT *rtu, const uint8_t *header,
+                       const uint8_t *pdu, uint len, bool refresh);
+
+// one block refreshed, the last one answers from the image
+static void ServerRefreshDone(ModbusXferT *xfer) {
+  ServerPendingT *pending = ((ServerRefreshT *)xfer)->pending;
+
+  free(xfer);
+  if (atomic_fetch_sub(&pending->pending, 1) != 1)
+    return;
+  ServerRead(pending->client, pending->rtu, pending->header, pending->pdu,
+             sizeof(pending->pdu), false);
+  ServerClientUnref(pending->client);
+  free(pending);
+}
+
+/**
+ * Read the outdated blocks of a request, then answer it
+ *
+ * Block reads go through the coalesced read path: when the values are
+ * already being polled, the request joins the poll in flight.
+ *
+ * @return 0 when the answer is deferred, -1 when nothing could be queued
+ */
+static int ServerRefresh(ServerClientT *client, ModbusRtuT *rtu, const uint8_t *header,
+                         const uint8_t *pdu, ModbusSensorT **sensors, uint count) {
+  ServerPendingT *pending;
+  ServerRefreshT *refresh;
+  uint queued = 0;
+
+  pending = (ServerPendingT *)calloc(1, sizeof(ServerPendingT));
+  if (!pending)
+    return -1;
+  pending->client = client;
+  pending->rtu = rtu;
+  memcpy(pending->header, header, SERVER_MBAP_LENGTH);
+  memcpy(pending->pdu, pdu, sizeof(pending->pdu));
+  // one extra count, released once every read is queued
+  atomic_init(&pending->pending, count + 1);
+  atomic_fetch_add(&client->refs, 1);
+
+  for (uint idx = 0; idx < count; idx++) {
+    refresh = (ServerRefreshT *)calloc(1, sizeof(ServerRefreshT));
+    if (refresh) {
+      refresh->pending = pending;
+      refresh->xfer.class = MB_CLASS_READ;
+      refresh->xfer.deadline = ModbusNowMs();
+      refresh->xfer.runCB = ModbusSensorReadRun;
+      refresh->xfer.doneCB = ServerRefreshDone;
+      refresh->xfer.context = sensors[idx];
+      if (!ModbusSensorReadSubmit(sensors[idx], &refresh->xfer)) {
+        queued++;
+        continue;
+      }
+      free(refresh);
+    }
+    atomic_fetch_sub(&pending->pending, 1);
+  }
+
+  if (!queued) {
+    atomic_fetch_sub(&client->refs, 1);
+    free(pending);
+    return -1;
+  }
+  if (atomic_fetch_sub(&pending->pending, 1) == 1) {
+    ServerRead(client, rtu, pending->header, pending->pdu, sizeof(pending->pdu), false);
+    ServerClientUnref(client);
+    free(pending);
+  }
+  return 0;
+}
+
+/**
+ * Functions 01-04, answered from the shadow image
+ *
+ * Values never read (or older than max_age) are read from the device
+ * first when 'refresh' is set, the answer is then sent once they are in.
+ */
+static void ServerRead(ServerClientT *client, ModbusRtuT *rtu, const uint8_t *header,
+                       const uint8_t *pdu, uint len, bool refresh) {
+  uint8_t function = pdu[0];
+  ModbusTypeE type = ServerFunctionType(function);
+  bool coil = type == MB_COIL_STATUS || type == MB_COIL_INPUT;
+  uint16_t values[MODBUS_MAX_READ_BITS];
+  uint8_t reply[MODBUS_MAX_PDU_LENGTH];
+  ModbusSensorT **sensors = NULL;
+  uint registry, count, bytes, nrefresh = 0;
+  int code;
+
+  if (len != 5) {
+    ServerException(client, header, function, SERVER_ILLEGAL_VALUE);
+    return;
+  }
+  registry = (pdu[1] << 8) | pdu[2];
+  count = (pdu[3] << 8) | pdu[4];
+  if (!count || count > (coil ? MODBUS_MAX_READ_BITS : MODBUS_MAX_READ_REGISTERS)) {
+    ServerException(client, header, function, SERVER_ILLEGAL_VALUE);
+    return;
+  }
+
+  if (refresh && rtu->connection->context && ModbusLinkUsable(rtu->connection)) {
+    pthread_mutex_lock(&rtu->mutex);
+    refresh = rtu->breakerstate != MB_BREAKER_OPEN;
+    pthread_mutex_unlock(&rtu->mutex);
+    if (refresh)
+      sensors = (ModbusSensorT **)alloca(count * sizeof(ModbusSensorT *));
+  }
+  code = ServerCopy(client->server, rtu, type, registry, count, values, sensors, &nrefresh);
+  if (code == SERVER_TARGET_FAILED && nrefresh &&
+      !ServerRefresh(client, rtu, header, pdu, sensors, nrefresh))
+    return;
+  if (code) {
+    ServerException(client, header, function, code);
+    return;
+  }
+
+  bytes = coil ? (count + 7) / 8 : count * 2;
+  reply[0] = function;
+  reply[1] = bytes;
+  memset(&reply[2], 0, bytes);
+  for (uint idx = 0; idx < count; idx++) {
+    if (coil) {
+      if (values[idx])
+        reply[2 + idx / 8] |= 1 << (idx % 8);
+    } else {
+      reply[2 + 2 * idx] = values[idx] >> 8;
+      reply[3 + 2 * idx] = values[idx] & 0xFF;
+    }
+  }
+  ServerReply(client, header, reply, 2 + bytes);
+}
+
+// write completed on the I/O thread, back on an afb job
+static void ServerWriteDone(ModbusXferT *xfer) {
+  ServerWriteT *write = (ServerWriteT *)xfer;
+  uint8_t function = write->reply[0];
+
+  if (!xfer->status) {
+    ServerReply(write->client, write->header, write->reply, sizeof(write->reply));
+  } else if (xfer->error > MODBUS_ENOBASE && xfer->error <= EMBXGTAR) {
+    // device exception, relayed as is
+    ServerException(write->client, write->header, function, xfer->error - MODBUS_ENOBASE);
+  } else {
+    ServerException(write->client, write->header, function, SERVER_TARGET_FAILED);
+  }
+  ServerClientUnref(write->client);
+  free(write);
+}
+
+// every written address must belong to a writable sensor of the RTU, and
+// cover whole elements of it: half a FLOAT or INT32 is never forwarded
+static bool ServerWritable(ModbusRtuT *rtu, ModbusTypeE type, uint registry, uint count) {
+  ModbusSensorT *sensor;
+  uint addr = registry, last = registry + count, end, element;
+
+  while (addr < last) {
+    for (sensor = rtu->sensors; sensor->uid; sensor++) {
+      if (sensor->function->type == type && sensor->function->writeCB &&
+          sensor->registry <= addr && addr < sensor->registry + ModbusSensorSpan(sensor))
+        break;
+    }
+    if (!sensor->uid)
+      return false;
+
+    end = sensor->registry + ModbusSensorSpan(sensor);
+    element = ModbusSensorSpan(sensor) / sensor->count;
+    if ((addr - sensor->registry) % element ||
+        ((last < end ? last : end) - sensor->registry) % element)
+      return false;
+    addr = end;
+  }
+  return true;
+}
+
+// functions 05, 06, 15 and 16, forwarded to the device
+static void ServerWrite(ServerClientT *client, ModbusRtuT *rtu, const uint8_t *header,
+                        const uint8_t *pdu, uint len) {
+  uint8_t function = pdu[0];
+  ServerWriteT *write;
+  ModbusRawWriteT *raw;
+  uint value, bytes;
+
+  write = (ServerWriteT *)calloc(1, sizeof(ServerWriteT));
+  if (!write) {
+    ServerException(client, header, function, SERVER_DEVICE_FAILURE);
+    return;
+  }
+  raw = &write->raw;
+  raw->api = client->server->api;
+  raw->type = ServerFunctionType(function);
+  if (len < 5)
+    goto OnValueError;
+  raw->registry = (pdu[1] << 8) | pdu[2];
+  value = (pdu[3] << 8) | pdu[4];
+
+  switch (function) {
+  case 0x05:
+    if (len != 5 || (value != 0xFF00 && value != 0x0000))
+      goto OnValueError;
+    raw->single = true;
+    raw->count = 1;
+    raw->bits[0] = value == 0xFF00;
+    break;
+  case 0x06:
+    if (len != 5)
+      goto OnValueError;
+    raw->single = true;
+    raw->count = 1;
+    raw->registers[0] = value;
+    break;
+  case 0x0F:
+    bytes = (value + 7) / 8;
+    if (!value || value > MODBUS_MAX_WRITE_BITS || len != 6 + bytes || pdu[5] != bytes)
+      goto OnValueError;
+    raw->count = value;
+    for (uint idx = 0; idx < value; idx++)
+      raw->bits[idx] = (pdu[6 + idx / 8] >> (idx % 8)) & 1;
+    break;
+  default:
+    if (!value || value > MODBUS_MAX_WRITE_REGISTERS || len != 6 + 2 * value ||
+        pdu[5] != 2 * value)
+      goto OnValueError;
+    raw->count = value;
+    for (uint idx = 0; idx < value; idx++)
+      raw->registers[idx] = (pdu[6 + 2 * idx] << 8) | pdu[7 + 2 * idx];
+    break;
+  }
+
+  if (!ServerWritable(rtu, raw->type, raw->registry, raw->count)) {
+    ServerException(client, header, function, SERVER_ILLEGAL_ADDRESS);
+    free(write);
+    return;
+  }
+
+  // single writes are echoed, multiple writes answer address and count
+  memcpy(write->header, header, SERVER_MBAP_LENGTH);
+  memcpy(write->reply, pdu, sizeof(write->reply));
+  write->client = client;
+  write->xfer.class = MB_CLASS_WRITE;
+  write->xfer.deadline = ModbusNowMs();
+  write->xfer.runCB = ModbusRawWriteRun;
+  write->xfer.doneCB = ServerWriteDone;
+  write->xfer.context = rtu;
+  write->xfer.data = raw;
+
+  atomic_fetch_add(&client->refs, 1);
+  if (!rtu->connection->context || ModbusXferSubmit(rtu->connection, &write->xfer)) {
+    atomic_fetch_sub(&client->refs, 1);
+    ServerException(client, header, function, SERVER_TARGET_FAILED);
+    free(write);
+  }
+  return;
+
+OnValueError:
+  ServerException(client, header, function, SERVER_ILLEGAL_VALUE);
+  free(write);
+}
+
+// dispatch one request ADU
+static void ServerRequest(ServerClientT *client, const uint8_t *adu, uint len) {
+  const uint8_t *pdu = &adu[SERVER_MBAP_LENGTH];
+  uint pdulen = len - SERVER_MBAP_LENGTH;
+  ModbusRtuT *rtu = client->server->units[adu[6]];
+
+  if (!rtu) {
+    ServerException(client, adu, pdu[0], SERVER_PATH_UNAVAILABLE);
+    return;
+  }
+  // the read plan is rebuilt when a startup connect completes
+  if (atomic_load_explicit(&rtu->connection->connecting, memory_order_acquire)) {
+    ServerException(client, adu, pdu[0], SERVER_TARGET_FAILED);
+    return;
+  }
+
+  switch (pdu[0]) {
+  case 0x01:
+  case 0x02:
+  case 0x03:
+  case 0x04:
+    ServerRead(client, rtu, adu, pdu, pdulen, true);
+    break;
+  case 0x05:
+  case 0x06:
+  case 0x0F:
+  case 0x10:
+    ServerWrite(client, rtu, adu, pdu, pdulen);
+    break;
+  default:
+    ServerException(client, adu, pdu[0], SERVER_ILLEGAL_FUNCTION);
+    break;
+  }
+}
+
+static void ServerClientEvent(afb_evfd_t evfd, int fd, uint32_t revents, void *closure) {
+  ServerClientT *client = (ServerClientT *)closure;
+  uint length, consumed = 0;
+  ssize_t got;
+
+  if (revents & (EPOLLERR | EPOLLHUP)) {
+    ServerClientClose(client);
+    return;
+  }
+
+  got = recv(fd, &client->rx[client->rxlen], sizeof(client->rx) - client->rxlen, 0);
+  if (got <= 0) {
+    if (got < 0 && (errno == EAGAIN || errno == EINTR))
+      return;
+    ServerClientClose(client);
+    return;
+  }
+  client->rxlen += got;
+
+  // clients may send several requests at once, replies carry their tid,
+  // the rest is dropped with the connection
+  atomic_fetch_add(&client->refs, 1);
+  while (ServerClientAlive(client) && client->rxlen - consumed >= SERVER_MBAP_LENGTH + 1) {
+    const uint8_t *adu = &client->rx[consumed];
+    length = (adu[4] << 8) | adu[5];
+    if (adu[2] || adu[3] || length < 2 || length > MODBUS_MAX_PDU_LENGTH + 1) {
+      // not Modbus/TCP, framing is lost
+      ServerClientClose(client);
+      break;
+    }
+    if (client->rxlen - consumed < SERVER_MBAP_LENGTH - 1 + length)
+      break;
+    ServerRequest(client, adu, SERVER_MBAP_LENGTH - 1 + length);
+    consumed += SERVER_MBAP_LENGTH - 1 + length;
+  }
+  memmove(client->rx, &client->rx[consumed], client->rxlen - consumed);
+  client->rxlen -= consumed;
+  ServerClientUnref(client);
+}
+
+static void ServerAccept(afb_evfd_t evfd, int fd, uint32_t revents, void *closure) {
+  ModbusServerT *server = (ModbusServerT *)closure;
+  ServerClientT *client;
+  int sock, flag = 1, err;
+
+  sock = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (sock < 0)
+    return;
+
+  if (atomic_fetch_add(&server->clients, 1) >= server->maxclients) {
+    atomic_fetch_sub(&server->clients, 1);
+    AFB_API_WARNING(server->api, "ModbusServer: too many clients, connection refused");
+    close(sock);
+    return;
+  }
+
+  client = (ServerClientT *)calloc(1, sizeof(ServerClientT));
+  if (!client) {
+    atomic_fetch_sub(&server->clients, 1);
+    close(sock);
+    return;
+  }
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  client->server = server;
+  client->fd = sock;
+  atomic_init(&client->refs, 1);
+  pthread_mutex_init(&client->mutex, NULL);
+
+  err = afb_evfd_create(&client->evfd, sock, EPOLLIN, ServerClientEvent, client, 0, 1);
+  if (err < 0) {
+    AFB_API_ERROR(server->api, "ModbusServer: fail to watch client error=%s", strerror(-err));
+    close(sock);
+    ServerClientUnref(client);
+  }
+}
+
+// listening socket on the first address the server URI resolves to
+static int ServerListen(afb_api_t api, const char *host, int port) {
+  struct addrinfo hints, *result = NULL;
+  char service[16];
+  int fd = -1, flag = 1, err;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  snprintf(service, sizeof(service), "%d", port);
+  err = getaddrinfo(*host && strcmp(host, "*") ? host : NULL, service, &hints, &result);
+  if (err) {
+    AFB_API_ERROR(api, "ModbusServer: cannot resolve host=%s error=%s", host, gai_strerror(err));
+    return -1;
+  }
+
+  fd = socket(result->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd < 0)
+    goto OnErrorExit;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+  if (bind(fd, result->ai_addr, result->ai_addrlen) < 0 || listen(fd, MB_SERVER_MAX_CLIENTS) < 0)
+    goto OnErrorExit;
+  freeaddrinfo(result);
+  return fd;
+
+OnErrorExit:
+  AFB_API_ERROR(api, "ModbusServer: cannot listen host=%s port=%d error=%s", host, port,
+                strerror(errno));
+  if (fd >= 0)
+    close(fd);
+  freeaddrinfo(result);
+  return -1;
+}
+
+/**
+ * Start the Modbus/TCP server when the config has a 'server' section
+ *
+ * "server": {"uri": "tcp://0.0.0.0:1502", "max_age": 0, "max_clients": 16}
+ *
+ * Each RTU is served under its slaveid, or its 'unit' when set. A unit
+ * claimed by two RTUs is kept by the first one.
+ *
+ * @return 0 = OK or no server, -1 on error
+ */
+int ModbusServerStart(afb_api_t api, CtlHandleT *controller) {
+  json_object *serverJ = NULL;
+  ModbusServerT *server;
+  ModbusRtuT *rtu;
+  const char *uri;
+  char *host = NULL;
+  int port, fd, err, maxage = 0, maxclients = MB_SERVER_MAX_CLIENTS, unit;
+
+  if (!json_object_object_get_ex(controller->config, "server", &serverJ))
+    return 0;
+
+  err = rp_jsonc_unpack(serverJ, "{ss s?i s?i !}", "uri", &uri, "max_age", &maxage,
+                        "max_clients", &maxclients);
+  if (err || maxage < 0 || maxclients <= 0 || ModbusParseURI(uri, &host, &port)) {
+    AFB_API_ERROR(api, "ModbusServerStart: invalid server config=%s",
+                  json_object_get_string(serverJ));
+    return -1;
+  }
+
+  server = (ModbusServerT *)calloc(1, sizeof(ModbusServerT));
+  if (!server) {
+    AFB_API_ERROR(api, "ModbusServerStart: out of memory");
+    free(host);
+    return -1;
+  }
+  server->api = api;
+  server->maxage = maxage;
+  server->maxclients = maxclients;
+
+  for (int idx = 0; controller->modbus && controller->modbus[idx].uid; idx++) {
+    rtu = &controller->modbus[idx];
+    unit = rtu->unit >= 0 ? rtu->unit : rtu->slaveid;
+    if (unit > 255) {
+      AFB_API_WARNING(api, "ModbusServerStart: rtu=%s unit=%d not served", rtu->uid, unit);
+      continue;
+    }
+    if (server->units[unit]) {
+      AFB_API_WARNING(api, "ModbusServerStart: rtu=%s unit=%d already served by rtu=%s",
+                      rtu->uid, unit, server->units[unit]->uid);
+      continue;
+    }
+    server->units[unit] = rtu;
+  }
+
+  fd = ServerListen(api, host, port);
+  if (fd < 0)
+    goto OnErrorExit;
+
+  err = afb_evfd_create(&server->evfd, fd, EPOLLIN, ServerAccept, server, 0, 1);
+  if (err < 0) {
+    AFB_API_ERROR(api, "ModbusServerStart: fail to watch socket error=%s", strerror(-err));
+    close(fd);
+    goto OnErrorExit;
+  }
+
+  AFB_API_NOTICE(api, "ModbusServerStart: serving Modbus/TCP on uri=%s", uri);
+  free(host);
+  return 0;
+
+OnErrorExit:
+  free(host);
+  free(server);
+  return -1;
+}
@@ -0,0 +1,517 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <modbus/modbus.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Native Modbus/TCP engine: MBAP frames are built here and the socket is
+// watched by the afb event loop, so no thread waits for responses. Up to
+// 'pipeline' requests are outstanding on the socket, responses are matched
+// by transaction ID and may come back in any order. Extra requests wait in
+// a backlog until a slot frees up.
+
+#define TCP_MBAP_LENGTH 7
+
+// response timeout when the RTU does not set one
+#ifndef MB_TCP_DEFAULT_TIMEOUT_MS
+#define MB_TCP_DEFAULT_TIMEOUT_MS 500
+#endif
+
+typedef struct TcpRequestS {
+  uint16_t tid;
+  uint8_t adu[MODBUS_TCP_MAX_ADU_LENGTH];
+  uint len;
+  uint timeout;         // response timeout (ms)
+  uint64_t expire;      // monotonic time (ms) once sent
+  int error;            // response does not answer the request, 0 = OK
+  ModbusTcpCbT callback;
+  void *closure;
+  struct TcpRequestS *next;
+} TcpRequestT;
+
+struct ModbusTcpS {
+  afb_api_t api;
+  ModbusConnectionT *connection;
+  char *host;
+  int port;
+  uint pipeline;                // max outstanding requests
+  pthread_mutex_t mutex;
+  int fd;
+  afb_evfd_t evfd;
+  uint16_t tid;
+  TcpRequestT *pending;         // sent, waiting for their response, FIFO
+  TcpRequestT **pendtail;
+  uint outstanding;
+  TcpRequestT *backlog;         // waiting for a pipeline slot, FIFO
+  TcpRequestT **backtail;
+  uint64_t armedat;             // expiry the timeout check is posted for, 0 = none
+  uint8_t rx[2 * MODBUS_TCP_MAX_ADU_LENGTH];
+  uint rxlen;
+};
+
+static void TcpEvent(afb_evfd_t evfd, int fd, uint32_t revents, void *closure);
+static void TcpTimeout(int signum, void *arg);
+
+// open the socket and register it with the event loop, mutex held
+static int TcpOpen(ModbusTcpT *tcp) {
+  int fd, err;
+
+  fd = ModbusTcpConnect(tcp->api, tcp->host, tcp->port, NULL);
+  if (fd < 0)
+    goto OnErrorExit;
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  err = afb_evfd_create(&tcp->evfd, fd, EPOLLIN, TcpEvent, tcp, 0, 1);
+  if (err < 0) {
+    close(fd);
+    errno = -err;
+    goto OnErrorExit;
+  }
+  tcp->fd = fd;
+  tcp->rxlen = 0;
+  return 0;
+
+OnErrorExit:
+  AFB_API_ERROR(tcp->api, "TcpOpen: fail to connect host=%s port=%d error=%s",
+                tcp->host, tcp->port, strerror(errno));
+  return -1;
+}
+
+// drop the socket, every request sent on it is failed, mutex held
+static void TcpClose(ModbusTcpT *tcp, TcpRequestT **failed) {
+  TcpRequestT *request;
+
+  if (tcp->evfd) {
+    afb_evfd_unref(tcp->evfd);
+    tcp->evfd = NULL;
+  }
+  tcp->fd = -1;
+
+  while ((request = tcp->pending)) {
+    tcp->pending = request->next;
+    request->next = *failed;
+    *failed = request;
+  }
+  tcp->pendtail = &tcp->pending;
+  tcp->outstanding = 0;
+}
+
+// call completion callbacks, never with mutex held
+static void TcpComplete(TcpRequestT *requests, int error, const uint8_t *pdu, uint len) {
+  TcpRequestT *request;
+
+  while ((request = requests)) {
+    requests = request->next;
+    request->callback(request->closure, error, pdu, len);
+    free(request);
+  }
+}
+
+// unlink a pending request, mutex held
+static void TcpUnlink(ModbusTcpT *tcp, TcpRequestT **prev, TcpRequestT *request) {
+  *prev = request->next;
+  if (tcp->pendtail == &request->next)
+    tcp->pendtail = prev;
+  tcp->outstanding--;
+}
+
+// post the timeout check for the earliest pending expiry, mutex held
+static void TcpArm(ModbusTcpT *tcp) {
+  TcpRequestT *request;
+  uint64_t expire = 0, now;
+
+  for (request = tcp->pending; request; request = request->next) {
+    if (!expire || request->expire < expire)
+      expire = request->expire;
+  }
+  // a check already posted for that time or earlier will rearm
+  if (!expire || (tcp->armedat && tcp->armedat <= expire))
+    return;
+
+  now = ModbusNowMs();
+  if (afb_job_post(expire > now ? expire - now : 0, 0, TcpTimeout, tcp, NULL) >= 0)
+    tcp->armedat = expire;
+}
+
+// send backlog requests while pipeline slots are free, mutex held
+static void TcpFlush(ModbusTcpT *tcp, TcpRequestT **failed) {
+  TcpRequestT *request;
+  ssize_t count;
+
+  while (tcp->backlog && tcp->outstanding < tcp->pipeline) {
+    if (tcp->fd < 0) {
+      // socket is reopened by the link reconnect, never on the request path
+      *tcp->backtail = *failed;
+      *failed = tcp->backlog;
+      tcp->backlog = NULL;
+      tcp->backtail = &tcp->backlog;
+      return;
+    }
+
+    request = tcp->backlog;
+    tcp->backlog = request->next;
+    if (!tcp->backlog)
+      tcp->backtail = &tcp->backlog;
+
+    // frames are tiny, a partial write means the socket is broken
+    count = send(tcp->fd, request->adu, request->len, MSG_NOSIGNAL);
+    if (count != (ssize_t)request->len) {
+      AFB_API_ERROR(tcp->api, "TcpFlush: fail to send uri=%s error=%s",
+                    tcp->connection->uri, count < 0 ? strerror(errno) : "partial write");
+      request->next = *failed;
+      *failed = request;
+      TcpClose(tcp, failed);
+      continue;
+    }
+
+    request->expire = ModbusNowMs() + request->timeout;
+    request->next = NULL;
+    *tcp->pendtail = request;
+    tcp->pendtail = &request->next;
+    tcp->outstanding++;
+  }
+  TcpArm(tcp);
+}
+
+// fail requests which did not get their response in time
+static void TcpTimeout(int signum, void *arg) {
+  ModbusTcpT *tcp = (ModbusTcpT *)arg;
+  TcpRequestT *request, **prev, *expired = NULL, *failed = NULL;
+  uint64_t now = ModbusNowMs();
+
+  pthread_mutex_lock(&tcp->mutex);
+  // a check posted for a later expiry stays armed
+  if (tcp->armedat <= now)
+    tcp->armedat = 0;
+  for (prev = &tcp->pending; (request = *prev);) {
+    if (request->expire > now) {
+      prev = &request->next;
+      continue;
+    }
+    TcpUnlink(tcp, prev, request);
+    request->next = expired;
+    expired = request;
+  }
+  TcpFlush(tcp, &failed);
+  pthread_mutex_unlock(&tcp->mutex);
+
+  TcpComplete(expired, ETIMEDOUT, NULL, 0);
+  TcpComplete(failed, ECONNRESET, NULL, 0);
+}
+
+// a response must come from the unit asked, for the function asked, with
+// the size this function answers
+static int TcpCheck(TcpRequestT *request, const uint8_t *frame, uint length) {
+  const uint8_t *query = &request->adu[TCP_MBAP_LENGTH];
+  const uint8_t *pdu = &frame[TCP_MBAP_LENGTH];
+  uint len = length - 1, quantity, bytes;
+
+  if (frame[6] != request->adu[6])
+    return EMBBADDATA;
+  if (pdu[0] == (query[0] | 0x80))
+    return len == 2 ? 0 : EMBBADDATA;
+  if (pdu[0] != query[0])
+    return EMBBADDATA;
+
+  switch (query[0]) {
+  case 0x01:
+  case 0x02:
+  case 0x03:
+  case 0x04:
+    quantity = (query[3] << 8) | query[4];
+    bytes = query[0] <= 0x02 ? (quantity + 7) / 8 : quantity * 2;
+    return len == 2 + bytes && pdu[1] == bytes ? 0 : EMBBADDATA;
+  default:
+    return 0;
+  }
+}
+
+// dispatch every complete frame of the receive buffer, mutex held
+static TcpRequestT *TcpParse(ModbusTcpT *tcp, TcpRequestT **failed) {
+  TcpRequestT *done = NULL, *request, **prev;
+  uint16_t tid, length;
+  uint offset = 0;
+
+  while (tcp->rxlen - offset >= TCP_MBAP_LENGTH) {
+    uint8_t *frame = &tcp->rx[offset];
+    tid = (frame[0] << 8) | frame[1];
+    length = (frame[4] << 8) | frame[5];
+
+    // length covers unit id and PDU, a protocol other than Modbus loses framing
+    if (frame[2] || frame[3] || length < 2 || length > MODBUS_MAX_PDU_LENGTH + 1) {
+      AFB_API_ERROR(tcp->api, "TcpParse: invalid frame protocol=%d length=%d uri=%s",
+                    (frame[2] << 8) | frame[3], length, tcp->connection->uri);
+      TcpClose(tcp, failed);
+      tcp->rxlen = 0;
+      return done;
+    }
+    if (tcp->rxlen - offset < (uint)(TCP_MBAP_LENGTH - 1 + length))
+      break;
+
+    for (prev = &tcp->pending; (request = *prev); prev = &request->next) {
+      if (request->tid == tid)
+        break;
+    }
+    if (request) {
+      TcpUnlink(tcp, prev, request);
+      request->error = TcpCheck(request, frame, length);
+      if (request->error)
+        AFB_API_WARNING(tcp->api,
+                        "TcpParse: mismatched response tid=%d unit=%d function=0x%02x uri=%s",
+                        tid, frame[6], frame[TCP_MBAP_LENGTH], tcp->connection->uri);
+      // keep the PDU with the request until completion
+      request->len = length - 1;
+      memcpy(request->adu, &frame[TCP_MBAP_LENGTH], request->len);
+      request->next = done;
+      done = request;
+    } else {
+      // late response of a timed out request
+      AFB_API_DEBUG(tcp->api, "TcpParse: drop unknown tid=%d uri=%s", tid,
+                    tcp->connection->uri);
+    }
+    offset += TCP_MBAP_LENGTH - 1 + length;
+  }
+
+  memmove(tcp->rx, &tcp->rx[offset], tcp->rxlen - offset);
+  tcp->rxlen -= offset;
+  return done;
+}
+
+static void TcpEvent(afb_evfd_t evfd, int fd, uint32_t revents, void *closure) {
+  ModbusTcpT *tcp = (ModbusTcpT *)closure;
+  TcpRequestT *done = NULL, *failed = NULL, *request;
+  ssize_t count;
+  uint8_t *pdu;
+
+  pthread_mutex_lock(&tcp->mutex);
+  if (tcp->evfd != evfd) {
+    pthread_mutex_unlock(&tcp->mutex);
+    return;
+  }
+
+  count = read(fd, &tcp->rx[tcp->rxlen], sizeof(tcp->rx) - tcp->rxlen);
+  if (count > 0) {
+    tcp->rxlen += count;
+    done = TcpParse(tcp, &failed);
+  } else if (count == 0 || (errno != EAGAIN && errno != EINTR) ||
+             (revents & (EPOLLHUP | EPOLLERR))) {
+    AFB_API_NOTICE(tcp->api, "TcpEvent: connection closed uri=%s", tcp->connection->uri);
+    TcpClose(tcp, &failed);
+  }
+  TcpFlush(tcp, &failed);
+  pthread_mutex_unlock(&tcp->mutex);
+
+  // exception responses carry the function code with bit 7 set
+  while ((request = done)) {
+    done = request->next;
+    pdu = request->adu;
+    if (request->error)
+      request->callback(request->closure, request->error, NULL, 0);
+    else if (request->len >= 2 && (pdu[0] & 0x80))
+      request->callback(request->closure, MODBUS_ENOBASE + pdu[1], NULL, 0);
+    else
+      request->callback(request->closure, 0, pdu, request->len);
+    free(request);
+  }
+  TcpComplete(failed, ECONNRESET, NULL, 0);
+}
+
+/**
+ * Create the native Modbus/TCP engine of a connection
+ *
+ * @param api AFB API for logging purposes
+ * @param connection link using the engine
+ * @param host gateway name or IPv4/IPv6 address
+ * @param port gateway TCP port
+ * @param pipeline maximum number of outstanding requests on the socket
+ * @return engine handle, NULL on error
+ */
+ModbusTcpT *ModbusTcpCreate(afb_api_t api, ModbusConnectionT *connection,
+                            const char *host, int port, uint pipeline) {
+  ModbusTcpT *tcp;
+
+  tcp = (ModbusTcpT *)calloc(1, sizeof(ModbusTcpT));
+  if (!tcp)
+    goto OnMemoryError;
+  tcp->host = strdup(host);
+  if (!tcp->host)
+    goto OnMemoryError;
+
+  tcp->api = api;
+  tcp->connection = connection;
+  tcp->port = port;
+  tcp->pipeline = pipeline;
+  tcp->fd = -1;
+  tcp->pendtail = &tcp->pending;
+  tcp->backtail = &tcp->backlog;
+  pthread_mutex_init(&tcp->mutex, NULL);
+
+  pthread_mutex_lock(&tcp->mutex);
+  if (TcpOpen(tcp) < 0) {
+    pthread_mutex_unlock(&tcp->mutex);
+    pthread_mutex_destroy(&tcp->mutex);
+    free(tcp->host);
+    free(tcp);
+    return NULL;
+  }
+  pthread_mutex_unlock(&tcp->mutex);
+  return tcp;
+
+OnMemoryError:
+  AFB_API_ERROR(api, "ModbusTcpCreate: out of memory");
+  if (tcp)
+    free(tcp);
+  return NULL;
+}
+
+/**
+ * Send one request PDU to a unit behind the gateway
+ *
+ * The callback is called once from the afb event loop: with error 0 and the
+ * response PDU, with the libmodbus errno of a device exception, or with
+ * ETIMEDOUT/ECONNRESET on transport failure.
+ *
+ * @param unit unit identifier (slave id)
+ * @param pdu request PDU, function code first
+ * @param len PDU length
+ * @param timeout response timeout (ms), 0 = default
+ * @return 0 when queued, -1 with errno set otherwise
+ */
+int ModbusTcpSend(ModbusTcpT *tcp, uint8_t unit, const uint8_t *pdu, uint len,
+                  uint timeout, ModbusTcpCbT callback, void *closure) {
+  TcpRequestT *request, *failed = NULL;
+
+  if (len > MODBUS_MAX_PDU_LENGTH) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  request = (TcpRequestT *)calloc(1, sizeof(TcpRequestT));
+  if (!request) {
+    errno = ENOMEM;
+    return -1;
+  }
+  request->callback = callback;
+  request->closure = closure;
+  request->timeout = timeout ? timeout : MB_TCP_DEFAULT_TIMEOUT_MS;
+  request->len = TCP_MBAP_LENGTH + len;
+
+  pthread_mutex_lock(&tcp->mutex);
+  request->tid = tcp->tid++;
+
+  // MBAP header: transaction id, protocol 0, length, unit id
+  request->adu[0] = request->tid >> 8;
+  request->adu[1] = request->tid & 0xFF;
+  request->adu[2] = 0;
+  request->adu[3] = 0;
+  request->adu[4] = (len + 1) >> 8;
+  request->adu[5] = (len + 1) & 0xFF;
+  request->adu[6] = unit;
+  memcpy(&request->adu[TCP_MBAP_LENGTH], pdu, len);
+
+  *tcp->backtail = request;
+  tcp->backtail = &request->next;
+  TcpFlush(tcp, &failed);
+  pthread_mutex_unlock(&tcp->mutex);
+
+  TcpComplete(failed, ECONNRESET, NULL, 0);
+  return 0;
+}
+
+/**
+ * Reopen the socket after a link failure
+ *
+ * Called by the connection I/O thread while the link reconnects, the
+ * connect may block up to MB_CONNECT_TIMEOUT_MS.
+ *
+ * @return 0 when connected, -1 with errno set otherwise
+ */
+int ModbusTcpReopen(ModbusTcpT *tcp) {
+  TcpRequestT *failed = NULL;
+  int err = 0;
+
+  pthread_mutex_lock(&tcp->mutex);
+  if (tcp->fd >= 0)
+    TcpClose(tcp, &failed);
+  err = TcpOpen(tcp);
+  pthread_mutex_unlock(&tcp->mutex);
+
+  TcpComplete(failed, ECONNRESET, NULL, 0);
+  return err;
+}
+
+/**
+ * Close the socket when the link is disconnected
+ *
+ * Requests sent or waiting for a slot complete with ECONNRESET. The engine
+ * is kept, the next connect opens it again with ModbusTcpReopen, after
+ * ModbusTcpTarget when admin gave the link another URI.
+ */
+void ModbusTcpClose(ModbusTcpT *tcp) {
+  TcpRequestT *failed = NULL;
+
+  pthread_mutex_lock(&tcp->mutex);
+  if (tcp->fd >= 0)
+    TcpClose(tcp, &failed);
+  TcpFlush(tcp, &failed);
+  pthread_mutex_unlock(&tcp->mutex);
+
+  TcpComplete(failed, ECONNRESET, NULL, 0);
+}
+
+// gateway used by the next ModbusTcpReopen
+int ModbusTcpTarget(ModbusTcpT *tcp, const char *host, int port) {
+  char *copy = strdup(host);
+
+  if (!copy) {
+    errno = ENOMEM;
+    return -1;
+  }
+  pthread_mutex_lock(&tcp->mutex);
+  free(tcp->host);
+  tcp->host = copy;
+  tcp->port = port;
+  pthread_mutex_unlock(&tcp->mutex);
+  return 0;
+}
+
+// number of requests sent and waiting for a slot
+uint ModbusTcpOutstanding(ModbusTcpT *tcp) {
+  TcpRequestT *request;
+  uint count;
+
+  pthread_mutex_lock(&tcp->mutex);
+  count = tcp->outstanding;
+  for (request = tcp->backlog; request; request = request->next)
+    count++;
+  pthread_mutex_unlock(&tcp->mutex);
+  return count;
+}
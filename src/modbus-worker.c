@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2015-2025 IoT.bzh Company
+ * Author "Fulup Ar Foll"
+ *
+ * $RP_BEGIN_LICENSE$
+ * Commercial License Usage
+ *  Licensees holding valid commercial IoT.bzh licenses may use this file in
+ *  accordance with the commercial license agreement provided with the
+ *  Software or, alternatively, in accordance with the terms contained in
+ *  a written agreement between you and The IoT.bzh Company. For licensing terms
+ *  and conditions see https://www.iot.bzh/terms-conditions. For further
+ *  information use the contact form at https://www.iot.bzh/contact.
+ *
+ * GNU General Public License Usage
+ *  Alternatively, this file may be used under the terms of the GNU General
+ *  Public license version 3. This license is as published by the Free Software
+ *  Foundation and appearing in the file LICENSE.GPLv3 included in the packaging
+ *  of this file. Please review the following information to ensure the GNU
+ *  General Public License requirements will be met
+ *  https://www.gnu.org/licenses/gpl-3.0.html.
+ * $RP_END_LICENSE$
+ */
+
+#define _GNU_SOURCE
+
+#include "modbus-binding.h"
+#include <errno.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// A connection owns one I/O thread, the only one touching its libmodbus
+// context. Verbs and polls submit transactions into a bounded lock-free
+// ring (many producers, one consumer). The thread drains the ring into
+// private per-class lists sorted by deadline, always runs the highest class
+// first, then completes the transaction back on an afb job, or wakes up a
+// synchronous caller.
+
+// number of transactions which may be pending on one connection
+#ifndef MB_WORKER_RING_SIZE
+#define MB_WORKER_RING_SIZE 256
+#endif
+
+typedef struct {
+  _Atomic size_t sequence;
+  ModbusXferT *xfer;
+} WorkerCellT;
+
+struct ModbusWorkerS {
+  afb_api_t api;
+  ModbusConnectionT *connection;
+  pthread_t thread;
+  int evfd;                              // wakes up the thread on submit
+  WorkerCellT ring[MB_WORKER_RING_SIZE];
+  _Atomic size_t head;                   // next slot for producers
+  size_t tail;                           // next slot for the thread
+  ModbusXferT *queues[MB_CLASS_COUNT];   // thread private, sorted by deadline
+  _Atomic uint depth[MB_CLASS_COUNT];    // submitted and not yet started
+  _Atomic uint outstanding;              // submitted and not yet completed
+  pthread_mutex_t mutex;                 // synchronous completions only
+  pthread_cond_t cond;
+};
+
+static const char *WorkerClassNames[MB_CLASS_COUNT] = {
+    "write", "read", "poll", "diag"};
+
+// bounded MPSC enqueue, fails when the ring is full
+static bool WorkerPush(ModbusWorkerT *worker, ModbusXferT *xfer) {
+  WorkerCellT *cell;
+  size_t pos, seq;
+  intptr_t diff;
+
+  pos = atomic_load_explicit(&worker->head, memory_order_relaxed);
+  for (;;) {
+    cell = &worker->ring[pos % MB_WORKER_RING_SIZE];
+    seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    diff = (intptr_t)seq - (intptr_t)pos;
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&worker->head, &pos, pos + 1,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed))
+        break;
+    } else if (diff < 0) {
+      return false;
+    } else {
+      pos = atomic_load_explicit(&worker->head, memory_order_relaxed);
+    }
+  }
+
+  cell->xfer = xfer;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  return true;
+}
+
+// single consumer dequeue, only called by the I/O thread
+static ModbusXferT *WorkerPop(ModbusWorkerT *worker) {
+  WorkerCellT *cell = &worker->ring[worker->tail % MB_WORKER_RING_SIZE];
+  ModbusXferT *xfer;
+  size_t seq;
+
+  seq = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+  if (seq != worker->tail + 1)
+    return NULL;
+
+  xfer = cell->xfer;
+  atomic_store_explicit(&cell->sequence, worker->tail + MB_WORKER_RING_SIZE,
+                        memory_order_release);
+  worker->tail++;
+  return xfer;
+}
+
+// move submitted transactions to their class list, in deadline order
+static void WorkerSort(ModbusWorkerT *worker) {
+  ModbusXferT *xfer, **prev;
+
+  while ((xfer = WorkerPop(worker))) {
+    for (prev = &worker->queues[xfer->class]; *prev; prev = &(*prev)->next) {
+      if ((*prev)->deadline > xfer->deadline)
+        break;
+    }
+    xfer->next = *prev;
+    *prev = xfer;
+  }
+}
+
+static ModbusXferT *WorkerNext(ModbusWorkerT *worker) {
+  ModbusXferT *xfer;
+
+  for (int class = 0; class < MB_CLASS_COUNT; class++) {
+    xfer = worker->queues[class];
+    if (xfer) {
+      worker->queues[class] = xfer->next;
+      xfer->next = NULL;
+      return xfer;
+    }
+  }
+  return NULL;
+}
+
+static void WorkerDone(int signum, void *arg) {
+  ModbusXferT *xfer = (ModbusXferT *)arg;
+
+  if (signum)
+    xfer->status = -1;
+  xfer->doneCB(xfer);
+}
+
+static void *WorkerThread(void *arg) {
+  ModbusWorkerT *worker = (ModbusWorkerT *)arg;
+  ModbusXferT *xfer;
+  uint64_t count;
+  int err;
+
+  for (;;) {
+    WorkerSort(worker);
+    xfer = WorkerNext(worker);
+    if (!xfer) {
+      // nothing left, sleep until next submit
+      if (read(worker->evfd, &count, sizeof(count)) < 0 && errno != EINTR) {
+        AFB_API_ERROR(worker->api, "WorkerThread: fail to wait uri=%s error=%s",
+                      worker->connection->uri, strerror(errno));
+        sleep(1);
+      }
+      continue;
+    }
+    atomic_fetch_sub(&worker->depth[xfer->class], 1);
+
+    // requester does not wait anymore, spare the bus
+    if (xfer->expire && ModbusNowMs() > xfer->expire) {
+      xfer->status = -1;
+      xfer->error = ETIMEDOUT;
+    } else if (xfer->class != MB_CLASS_DIAG && !ModbusLinkUsable(xfer->link)) {
+      // link lost after submit, fail fast while it reconnects
+      xfer->status = -1;
+      xfer->error = ENOTCONN;
+    } else {
+      errno = 0;
+      xfer->status = xfer->runCB(xfer);
+      xfer->error = errno;
+    }
+    atomic_fetch_sub(&worker->outstanding, 1);
+
+    if (xfer->doneCB) {
+      err = afb_job_post(0, 0, WorkerDone, xfer, NULL);
+      if (err < 0) {
+        AFB_API_ERROR(worker->api, "WorkerThread: fail to post completion uri=%s",
+                      worker->connection->uri);
+        WorkerDone(0, xfer);
+      }
+    } else {
+      pthread_mutex_lock(&worker->mutex);
+      xfer->completed = true;
+      pthread_cond_broadcast(&worker->cond);
+      pthread_mutex_unlock(&worker->mutex);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * Start the I/O thread of a connection
+ *
+ * @param api AFB API for logging purposes
+ * @param connection link served by the thread
+ * @return worker handle, NULL on error
+ */
+ModbusWorkerT *ModbusWorkerStart(afb_api_t api, ModbusConnectionT *connection) {
+  ModbusWorkerT *worker;
+  int err;
+
+  worker = (ModbusWorkerT *)calloc(1, sizeof(ModbusWorkerT));
+  if (!worker) {
+    AFB_API_ERROR(api, "ModbusWorkerStart: out of memory");
+    goto OnErrorExit;
+  }
+  worker->api = api;
+  worker->connection = connection;
+  for (size_t idx = 0; idx < MB_WORKER_RING_SIZE; idx++)
+    atomic_init(&worker->ring[idx].sequence, idx);
+  pthread_mutex_init(&worker->mutex, NULL);
+  pthread_cond_init(&worker->cond, NULL);
+
+  worker->evfd = eventfd(0, EFD_CLOEXEC);
+  if (worker->evfd < 0) {
+    AFB_API_ERROR(api, "ModbusWorkerStart: fail to create eventfd uri=%s",
+                  connection->uri);
+    goto OnErrorExit;
+  }
+
+  err = pthread_create(&worker->thread, NULL, WorkerThread, worker);
+  if (err) {
+    AFB_API_ERROR(api, "ModbusWorkerStart: fail to start thread uri=%s error=%s",
+                  connection->uri, strerror(err));
+    close(worker->evfd);
+    goto OnErrorExit;
+  }
+  pthread_detach(worker->thread);
+  return worker;
+
+OnErrorExit:
+  free(worker);
+  return NULL;
+}
+
+// transactions and native requests not yet completed on one pool socket
+static uint WorkerLoad(ModbusConnectionT *link) {
+  uint load = 0;
+
+  if (link->worker)
+    load += atomic_load(&link->worker->outstanding);
+  if (link->tcp)
+    load += ModbusTcpOutstanding(link->tcp);
+  return load;
+}
+
+/**
+ * Pick the pool socket with the fewest outstanding transactions
+ *
+ * Sockets which are not connected are skipped, the pool head is returned
+ * when none is.
+ */
+ModbusConnectionT *ModbusConnectionPick(ModbusConnectionT *connection) {
+  ModbusConnectionT *link, *best = NULL;
+  uint load, bestload = 0;
+
+  for (link = connection; link; link = link->next) {
+    if (!link->context || !link->worker || !ModbusLinkUsable(link))
+      continue;
+    load = WorkerLoad(link);
+    if (!best || load < bestload) {
+      best = link;
+      bestload = load;
+    }
+  }
+  return best ? best : connection;
+}
+
+/**
+ * Queue a transaction on a connection I/O thread
+ *
+ * runCB is executed on the I/O thread with the bus owned, then doneCB on
+ * an afb job. The transaction must stay allocated until doneCB. Unless
+ * the caller pinned xfer->link, the least loaded socket of the pool runs
+ * it. Only diagnostics are accepted while the link is down or
+ * reconnecting, others fail fast with ENOTCONN.
+ *
+ * @return 0 when queued, -1 with errno set otherwise
+ */
+int ModbusXferSubmit(ModbusConnectionT *connection, ModbusXferT *xfer) {
+  ModbusWorkerT *worker;
+  uint64_t one = 1;
+
+  if (!xfer->link)
+    xfer->link = ModbusConnectionPick(connection);
+  worker = xfer->link->worker;
+  if (!worker || (xfer->class != MB_CLASS_DIAG && !ModbusLinkUsable(xfer->link))) {
+    errno = ENOTCONN;
+    return -1;
+  }
+
+  xfer->completed = false;
+  atomic_fetch_add(&worker->depth[xfer->class], 1);
+  atomic_fetch_add(&worker->outstanding, 1);
+  if (!WorkerPush(worker, xfer)) {
+    atomic_fetch_sub(&worker->depth[xfer->class], 1);
+    atomic_fetch_sub(&worker->outstanding, 1);
+    AFB_API_WARNING(worker->api, "ModbusXferSubmit: queue full uri=%s",
+                    connection->uri);
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if (write(worker->evfd, &one, sizeof(one)) < 0) {
+    AFB_API_ERROR(worker->api, "ModbusXferSubmit: fail to wake up thread uri=%s",
+                  connection->uri);
+  }
+  return 0;
+}
+
+/**
+ * Run a transaction on the connection I/O thread and wait for its result
+ *
+ * errno of the I/O thread is restored in the caller thread.
+ *
+ * @return runCB status, -1 when the transaction could not be queued
+ */
+int ModbusXferRun(ModbusConnectionT *connection, ModbusXferT *xfer) {
+  ModbusWorkerT *worker;
+  int err;
+
+  xfer->doneCB = NULL;
+  err = ModbusXferSubmit(connection, xfer);
+  if (err)
+    return -1;
+  worker = xfer->link->worker;
+
+  pthread_mutex_lock(&worker->mutex);
+  while (!xfer->completed)
+    pthread_cond_wait(&worker->cond, &worker->mutex);
+  pthread_mutex_unlock(&worker->mutex);
+
+  errno = xfer->error;
+  return xfer->status;
+}
+
+// number of transactions waiting for the bus in each class, whole pool
+json_object *ModbusConnectionQueues(ModbusConnectionT *connection) {
+  json_object *queuesJ = json_object_new_object();
+  ModbusConnectionT *link;
+  uint depth;
+
+  for (int class = 0; class < MB_CLASS_COUNT; class++) {
+    depth = 0;
+    for (link = connection; link; link = link->next) {
+      if (link->worker)
+        depth += atomic_load(&link->worker->depth[class]);
+    }
+    json_object_object_add(queuesJ, WorkerClassNames[class], json_object_new_int(depth));
+  }
+  return queuesJ;
+}